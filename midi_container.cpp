@@ -1,88 +1,308 @@
 #include "midi_container.h"
 
+#include <errno.h>
 #include <string.h>
 
-#include <algorithm>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
-midi_event::midi_event( const midi_event & p_in )
-{
-	m_timestamp = p_in.m_timestamp;
-	m_channel = p_in.m_channel;
-	m_type = p_in.m_type;
-	m_data_count = p_in.m_data_count;
-	memcpy( m_data, p_in.m_data, m_data_count );
-	m_ext_data = p_in.m_ext_data;
-}
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
 
 midi_event::midi_event( unsigned long p_timestamp, event_type p_type, unsigned p_channel, const uint8_t * p_data, std::size_t p_data_count )
 {
 	m_timestamp = p_timestamp;
 	m_type = p_type;
 	m_channel = p_channel;
-	if ( p_data_count <= max_static_data_count )
-	{
-		m_data_count = p_data_count;
-		memcpy( m_data, p_data, p_data_count );
-	}
-	else
-	{
-		m_data_count = max_static_data_count;
-		memcpy( m_data, p_data, max_static_data_count );
-        m_ext_data.assign( p_data + max_static_data_count, p_data + p_data_count );
-	}
+	m_data_count = p_data_count;
+	m_data = p_data;
 }
 
 unsigned long midi_event::get_data_count() const
 {
-    return m_data_count + m_ext_data.size();
+    return m_data_count;
 }
 
 void midi_event::copy_data( uint8_t * p_out, unsigned long p_offset, unsigned long p_count ) const
 {
-    unsigned long max_count = m_data_count + m_ext_data.size() - p_offset;
+    if ( p_offset >= m_data_count ) return;
+    unsigned long max_count = m_data_count - p_offset;
     p_count = std::min( p_count, max_count );
-	if ( p_offset < max_static_data_count )
+    if ( p_count ) memcpy( p_out, m_data + p_offset, p_count );
+}
+
+midi_thread_executor::midi_thread_executor( unsigned p_thread_count )
+{
+    if ( !p_thread_count ) p_thread_count = std::thread::hardware_concurrency();
+    m_thread_count = p_thread_count ? p_thread_count : 1;
+}
+
+static void run_executor_tasks( std::atomic<std::size_t> * p_next, std::size_t p_count, const std::function<void( std::size_t )> * p_task )
+{
+    for (;;)
+	{
+        std::size_t index = p_next->fetch_add( 1 );
+        if ( index >= p_count ) break;
+        (*p_task)( index );
+	}
+}
+
+void midi_thread_executor::run( std::size_t p_count, const std::function<void( std::size_t )> & p_task )
+{
+    std::atomic<std::size_t> next( 0 );
+
+    std::size_t worker_count = std::min<std::size_t>( m_thread_count, p_count );
+    std::vector<std::thread> workers;
+    for ( std::size_t i = 1; i < worker_count; ++i )
+        workers.push_back( std::thread( run_executor_tasks, &next, p_count, &p_task ) );
+
+    run_executor_tasks( &next, p_count, &p_task );
+
+    for ( std::size_t i = 0; i < workers.size(); ++i )
+        workers[ i ].join();
+}
+
+class midi_new_delete_resource : public midi_memory_resource
+{
+protected:
+    virtual void * do_allocate( std::size_t p_bytes, std::size_t )
+    {
+        return ::operator new( p_bytes );
+    }
+
+    virtual void do_deallocate( void * p_ptr, std::size_t, std::size_t )
+    {
+        ::operator delete( p_ptr );
+    }
+
+    virtual bool do_is_equal( const midi_memory_resource & p_other ) const
+    {
+        return !!dynamic_cast<const midi_new_delete_resource *>( &p_other );
+    }
+};
+
+static midi_new_delete_resource g_default_resource;
+
+midi_memory_resource * midi_memory_resource::get_default()
+{
+    return &g_default_resource;
+}
+
+midi_monotonic_buffer_resource::midi_monotonic_buffer_resource( std::size_t p_initial_size, midi_memory_resource * p_upstream )
+{
+    m_upstream = p_upstream ? p_upstream : midi_memory_resource::get_default();
+    m_next_block_size = p_initial_size ? p_initial_size : 1024;
+    m_blocks = 0;
+    m_current = 0;
+    m_remaining = 0;
+}
+
+midi_monotonic_buffer_resource::~midi_monotonic_buffer_resource()
+{
+    release();
+}
+
+void midi_monotonic_buffer_resource::release()
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    while ( m_blocks )
+	{
+        block_header * next = m_blocks->m_next;
+        m_upstream->deallocate( m_blocks, m_blocks->m_size, std::alignment_of<block_header>::value );
+        m_blocks = next;
+	}
+    m_current = 0;
+    m_remaining = 0;
+}
+
+void * midi_monotonic_buffer_resource::do_allocate( std::size_t p_bytes, std::size_t p_alignment )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+
+    if ( !p_alignment ) p_alignment = 1;
+
+    std::size_t padding = ( p_alignment - ( (uintptr_t) m_current & ( p_alignment - 1 ) ) ) & ( p_alignment - 1 );
+    if ( !m_current || padding + p_bytes > m_remaining )
 	{
-		unsigned long _max_count = max_static_data_count - p_offset;
-        unsigned long count = std::min( _max_count, p_count );
-		memcpy( p_out, m_data + p_offset, count );
-		p_offset -= count;
-		p_count -= count;
-		p_out += count;
+        /* Blocks start 16 bytes past their header, which keeps any sane alignment reachable */
+        const std::size_t header_size = ( sizeof( block_header ) + 15 ) & ~(std::size_t)15;
+        std::size_t block_size = std::max( m_next_block_size, header_size + p_bytes + p_alignment );
+        block_header * block = static_cast<block_header *>( m_upstream->allocate( block_size, std::alignment_of<block_header>::value ) );
+        block->m_next = m_blocks;
+        block->m_size = block_size;
+        m_blocks = block;
+        m_current = (uint8_t *) block + header_size;
+        m_remaining = block_size - header_size;
+        m_next_block_size = block_size * 2;
+        padding = ( p_alignment - ( (uintptr_t) m_current & ( p_alignment - 1 ) ) ) & ( p_alignment - 1 );
 	}
-    if ( p_count ) memcpy( p_out, &m_ext_data[0], p_count );
+
+    void * ptr = m_current + padding;
+    m_current += padding + p_bytes;
+    m_remaining -= padding + p_bytes;
+    return ptr;
+}
+
+void midi_monotonic_buffer_resource::do_deallocate( void *, std::size_t, std::size_t )
+{
+}
+
+bool midi_monotonic_buffer_resource::do_is_equal( const midi_memory_resource & p_other ) const
+{
+    return this == &p_other;
+}
+
+midi_track::midi_track( midi_memory_resource * p_resource )
+    : m_events( midi_allocator<event_record>( p_resource ) ), m_payload( midi_allocator<uint8_t>( p_resource ) )
+{
 }
 
 midi_track::midi_track(const midi_track & p_in)
+    : m_events( p_in.m_events ), m_payload( p_in.m_payload )
+{
+}
+
+midi_track::midi_track(const midi_track & p_in, midi_memory_resource * p_resource)
+    : m_events( p_in.m_events.begin(), p_in.m_events.end(), midi_allocator<event_record>( p_resource ) ),
+      m_payload( p_in.m_payload.begin(), p_in.m_payload.end(), midi_allocator<uint8_t>( p_resource ) )
+{
+}
+
+midi_track::midi_track(midi_track && p_in) noexcept
+    : m_events( std::move( p_in.m_events ) ), m_payload( std::move( p_in.m_payload ) )
+{
+}
+
+midi_track & midi_track::operator = (const midi_track & p_in)
 {
 	m_events = p_in.m_events;
+	m_payload = p_in.m_payload;
+	return *this;
+}
+
+midi_track & midi_track::operator = (midi_track && p_in) noexcept
+{
+	m_events = std::move( p_in.m_events );
+	m_payload = std::move( p_in.m_payload );
+	return *this;
+}
+
+void midi_track::pack_event( event_record & p_out, const midi_event & p_event )
+{
+	/* Saturate rather than wrap, so overlong tracks keep their event order */
+	p_out.m_timestamp = p_event.m_timestamp > 0xFFFFFFFFUL ? 0xFFFFFFFFU : (uint32_t) p_event.m_timestamp;
+	p_out.m_type = (uint8_t) p_event.m_type;
+	p_out.m_channel = (uint8_t) p_event.m_channel;
+	p_out.m_reserved = 0;
+	if ( p_event.m_data_count <= max_inline_data_count )
+	{
+		p_out.m_data_count = (uint8_t) p_event.m_data_count;
+		p_out.m_offset = 0;
+		if ( p_event.m_data_count ) memcpy( p_out.m_data, p_event.m_data, p_event.m_data_count );
+	}
+	else
+	{
+		uint32_t data_count = (uint32_t) p_event.m_data_count;
+		const uint8_t * data = p_event.m_data;
+		std::vector<uint8_t> temp;
+
+		/* Re-adding one of our own events would read from storage that insert may reallocate */
+		if ( m_payload.size() && data >= &m_payload[0] && data < &m_payload[0] + m_payload.size() )
+		{
+			temp.assign( data, data + data_count );
+			data = &temp[0];
+		}
+
+		p_out.m_data_count = 0xFF;
+		p_out.m_offset = (uint32_t) m_payload.size();
+		m_payload.insert( m_payload.end(), (const uint8_t *) &data_count, (const uint8_t *) &data_count + sizeof( data_count ) );
+		m_payload.insert( m_payload.end(), data, data + data_count );
+	}
+}
+
+midi_event midi_track::unpack_event( const event_record & p_record ) const
+{
+	if ( p_record.m_data_count <= max_inline_data_count )
+	{
+		return midi_event( p_record.m_timestamp, (midi_event::event_type) p_record.m_type, p_record.m_channel, p_record.m_data, p_record.m_data_count );
+	}
+	else
+	{
+		uint32_t data_count;
+		const uint8_t * data = &m_payload[ p_record.m_offset ];
+		memcpy( &data_count, data, sizeof( data_count ) );
+		return midi_event( p_record.m_timestamp, (midi_event::event_type) p_record.m_type, p_record.m_channel, data + sizeof( data_count ), data_count );
+	}
+}
+
+bool midi_track::is_end_of_track( const event_record & p_record ) const
+{
+	if ( p_record.m_type != midi_event::extended ) return false;
+	midi_event event = unpack_event( p_record );
+	return event.get_data_count() >= 2 && event.m_data[ 0 ] == 0xFF && event.m_data[ 1 ] == 0x2F;
+}
+
+void midi_track::append_event( const midi_event & p_event )
+{
+    event_record record;
+    pack_event( record, p_event );
+    m_events.push_back( record );
+}
+
+bool midi_track::timestamp_less( const event_record & p_a, const event_record & p_b )
+{
+	return p_a.m_timestamp < p_b.m_timestamp;
+}
+
+void midi_track::sort_events()
+{
+    std::stable_sort( m_events.begin(), m_events.end(), timestamp_less );
+
+    auto it = m_events.begin();
+    while ( it < m_events.end() && !is_end_of_track( *it ) ) ++it;
+
+    if ( it < m_events.end() )
+	{
+        event_record end_of_track = *it;
+        m_events.erase( it );
+        if ( m_events.size() && m_events.back().m_timestamp > end_of_track.m_timestamp )
+            end_of_track.m_timestamp = m_events.back().m_timestamp;
+        m_events.push_back( end_of_track );
+	}
 }
 
 void midi_track::add_event( const midi_event & p_event )
 {
+    event_record record;
+    pack_event( record, p_event );
+
     auto it = m_events.end();
 
     if ( m_events.size() )
 	{
-        midi_event & event = *(it - 1);
-		if ( event.m_type == midi_event::extended && event.get_data_count() >= 2 &&
-			event.m_data[ 0 ] == 0xFF && event.m_data[ 1 ] == 0x2F )
+        event_record & last = *(it - 1);
+		if ( is_end_of_track( last ) )
 		{
             --it;
-			if ( event.m_timestamp < p_event.m_timestamp )
+			if ( last.m_timestamp < record.m_timestamp )
 			{
-				event.m_timestamp = p_event.m_timestamp;
+				last.m_timestamp = record.m_timestamp;
 			}
 		}
 
         while ( it > m_events.begin() )
 		{
-            if ( (*( it - 1 )).m_timestamp <= p_event.m_timestamp ) break;
+            if ( (*( it - 1 )).m_timestamp <= record.m_timestamp ) break;
             --it;
 		}
 	}
 
-    m_events.insert( it, p_event );
+    m_events.insert( it, record );
 }
 
 std::size_t midi_track::get_count() const
@@ -90,9 +310,9 @@ std::size_t midi_track::get_count() const
     return m_events.size();
 }
 
-const midi_event & midi_track::operator [] ( std::size_t p_index ) const
+midi_event midi_track::operator [] ( std::size_t p_index ) const
 {
-	return m_events[ p_index ];
+	return unpack_event( m_events[ p_index ] );
 }
 
 void midi_track::remove_event( unsigned long index )
@@ -100,12 +320,90 @@ void midi_track::remove_event( unsigned long index )
     m_events.erase( m_events.begin() + index );
 }
 
+midi_memory_resource * midi_track::get_memory_resource() const
+{
+    return m_events.get_allocator().resource();
+}
+
+void midi_track_builder::add_event( const midi_event & p_event )
+{
+    std::size_t count = m_track.m_events.size();
+    if ( count )
+	{
+        const midi_track::event_record & last = m_track.m_events[ count - 1 ];
+        if ( p_event.m_timestamp < last.m_timestamp || m_track.is_end_of_track( last ) )
+            m_sorted = false;
+	}
+    m_track.append_event( p_event );
+}
+
+std::size_t midi_track_builder::get_count() const
+{
+    return m_track.get_count();
+}
+
+midi_track & midi_track_builder::finalize()
+{
+    if ( !m_sorted )
+	{
+        m_track.sort_events();
+        m_sorted = true;
+	}
+    return m_track;
+}
+
 tempo_entry::tempo_entry(unsigned long p_timestamp, unsigned p_tempo)
 {
 	m_timestamp = p_timestamp;
 	m_tempo = p_tempo;
 }
 
+static inline unsigned long tempo_ticks_to_ms( unsigned p_tempo, unsigned long p_ticks, unsigned p_half_dtx, unsigned p_dtx )
+{
+    return ((uint64_t)p_tempo * (uint64_t)p_ticks + p_half_dtx) / p_dtx;
+}
+
+/*
+ * Same rounding as tempo_ticks_to_ms with p_divisor = dtx * 1000000.
+ * Splitting off the whole multiples of the divisor keeps every product
+ * within 64 bits for divisors below 2^36 and rates below 2^28.
+ */
+static inline uint64_t tempo_ticks_to_samples( unsigned p_tempo, unsigned long p_ticks, uint64_t p_divisor, unsigned p_sample_rate )
+{
+    uint64_t scaled = (uint64_t)p_tempo * (uint64_t)p_ticks;
+    return scaled / p_divisor * p_sample_rate + ( scaled % p_divisor * p_sample_rate + p_divisor / 2 ) / p_divisor;
+}
+
+void tempo_map::update_index( std::size_t p_from )
+{
+    if ( !m_division ) return;
+
+    unsigned half_dtx = m_division * 500;
+    unsigned dtx = half_dtx * 2;
+
+    m_entry_ms.resize( m_entries.size() );
+
+    if ( !p_from && m_entries.size() )
+	{
+        m_entry_ms[ 0 ] = 0;
+        p_from = 1;
+	}
+
+    for ( std::size_t i = p_from; i < m_entries.size(); ++i )
+	{
+        unsigned long delta = m_entries[ i ].m_timestamp - m_entries[ i - 1 ].m_timestamp;
+        m_entry_ms[ i ] = m_entry_ms[ i - 1 ] + tempo_ticks_to_ms( m_entries[ i - 1 ].m_tempo, delta, half_dtx, dtx );
+	}
+}
+
+void tempo_map::set_division( unsigned p_dtx )
+{
+    if ( m_division == p_dtx ) return;
+    m_division = p_dtx;
+    if ( p_dtx ) update_index( 0 );
+    else m_entry_ms.clear();
+}
+
 void tempo_map::add_tempo( unsigned p_tempo, unsigned long p_timestamp )
 {
     auto it = m_entries.end();
@@ -119,34 +417,56 @@ void tempo_map::add_tempo( unsigned p_tempo, unsigned long p_timestamp )
     if ( it > m_entries.begin() && (*( it - 1 )).m_timestamp == p_timestamp )
 	{
         (*( it - 1 )).m_tempo = p_tempo;
+        update_index( it - m_entries.begin() );
 	}
 	else
 	{
+        std::size_t index = it - m_entries.begin();
         m_entries.insert( it, tempo_entry( p_timestamp, p_tempo ) );
+        update_index( index );
 	}
 }
 
-unsigned long tempo_map::timestamp_to_ms( unsigned long p_timestamp, unsigned p_dtx ) const
+static bool tempo_entry_timestamp_less( unsigned long p_timestamp, const tempo_entry & p_entry )
+{
+    return p_timestamp < p_entry.m_timestamp;
+}
+
+unsigned long tempo_map::timestamp_to_ms( unsigned long p_timestamp, unsigned p_dtx, unsigned p_initial_tempo /* = 500000 */ ) const
 {
+    unsigned half_dtx = p_dtx * 500;
+
+    if ( p_dtx && p_dtx == m_division )
+	{
+        p_dtx = half_dtx * 2;
+
+        /* Number of entries at or before the timestamp */
+        std::size_t count = std::upper_bound( m_entries.begin(), m_entries.end(), p_timestamp, tempo_entry_timestamp_less ) - m_entries.begin();
+        if ( !count ) return tempo_ticks_to_ms( p_initial_tempo, p_timestamp, half_dtx, p_dtx );
+
+        const tempo_entry & entry = m_entries[ count - 1 ];
+        return tempo_ticks_to_ms( p_initial_tempo, m_entries[ 0 ].m_timestamp, half_dtx, p_dtx ) + m_entry_ms[ count - 1 ] +
+            tempo_ticks_to_ms( entry.m_tempo, p_timestamp - entry.m_timestamp, half_dtx, p_dtx );
+	}
+
 	unsigned long timestamp_ms = 0;
 	unsigned long timestamp = 0;
     auto tempo_it = m_entries.begin();
-	unsigned current_tempo = 500000;
+	unsigned current_tempo = p_initial_tempo;
 
-    unsigned half_dtx = p_dtx * 500;
     p_dtx = half_dtx * 2;
 
     while ( tempo_it < m_entries.end() && timestamp + p_timestamp >= (*tempo_it).m_timestamp )
 	{
         unsigned long delta = (*tempo_it).m_timestamp - timestamp;
-        timestamp_ms += ((uint64_t)current_tempo * (uint64_t)delta + half_dtx) / p_dtx;
+        timestamp_ms += tempo_ticks_to_ms( current_tempo, delta, half_dtx, p_dtx );
         current_tempo = (*tempo_it).m_tempo;
         ++tempo_it;
 		timestamp += delta;
 		p_timestamp -= delta;
 	}
 
-    timestamp_ms += ((uint64_t)current_tempo * (uint64_t)p_timestamp + half_dtx) / p_dtx;
+    timestamp_ms += tempo_ticks_to_ms( current_tempo, p_timestamp, half_dtx, p_dtx );
 
 	return timestamp_ms;
 }
@@ -161,6 +481,67 @@ const tempo_entry & tempo_map::operator [] ( std::size_t p_index ) const
 	return m_entries[ p_index ];
 }
 
+tempo_map_cursor::tempo_map_cursor( const tempo_map * p_map, unsigned p_dtx, unsigned p_initial_tempo /* = 500000 */, unsigned p_sample_rate /* = 0 */ )
+{
+    m_map = p_map;
+    m_dtx = p_dtx;
+    m_initial_tempo = p_initial_tempo;
+    m_sample_rate = p_sample_rate;
+    reset();
+}
+
+void tempo_map_cursor::reset()
+{
+    m_index = 0;
+    m_tempo = m_initial_tempo;
+    m_timestamp = 0;
+    m_timestamp_ms = 0;
+    m_timestamp_samples = 0;
+}
+
+void tempo_map_cursor::advance( unsigned long p_timestamp )
+{
+    if ( p_timestamp < m_timestamp ) reset();
+
+    if ( m_map )
+	{
+        unsigned half_dtx = m_dtx * 500;
+        unsigned dtx = half_dtx * 2;
+        uint64_t divisor = (uint64_t)m_dtx * 1000000;
+
+        std::size_t count = m_map->get_count();
+        while ( m_index < count && p_timestamp >= (*m_map)[ m_index ].m_timestamp )
+		{
+            const tempo_entry & entry = (*m_map)[ m_index ];
+            m_timestamp_ms += tempo_ticks_to_ms( m_tempo, entry.m_timestamp - m_timestamp, half_dtx, dtx );
+            if ( m_sample_rate )
+                m_timestamp_samples += tempo_ticks_to_samples( m_tempo, entry.m_timestamp - m_timestamp, divisor, m_sample_rate );
+            m_tempo = entry.m_tempo;
+            m_timestamp = entry.m_timestamp;
+            ++m_index;
+		}
+	}
+}
+
+unsigned long tempo_map_cursor::timestamp_to_ms( unsigned long p_timestamp )
+{
+    unsigned half_dtx = m_dtx * 500;
+    unsigned dtx = half_dtx * 2;
+
+    advance( p_timestamp );
+
+    return m_timestamp_ms + tempo_ticks_to_ms( m_tempo, p_timestamp - m_timestamp, half_dtx, dtx );
+}
+
+unsigned long tempo_map_cursor::timestamp_to_samples( unsigned long p_timestamp )
+{
+    uint64_t divisor = (uint64_t)m_dtx * 1000000;
+
+    advance( p_timestamp );
+
+    return (unsigned long)( m_timestamp_samples + tempo_ticks_to_samples( m_tempo, p_timestamp - m_timestamp, divisor, m_sample_rate ) );
+}
+
 system_exclusive_entry::system_exclusive_entry(const system_exclusive_entry & p_in)
 {
 	m_port = p_in.m_port;
@@ -175,21 +556,36 @@ system_exclusive_entry::system_exclusive_entry(std::size_t p_port, std::size_t p
 	m_length = p_length;
 }
 
+uint32_t system_exclusive_table::hash_entry( const uint8_t * p_data, std::size_t p_size, std::size_t p_port )
+{
+    /* FNV-1a over the port, length and message bytes */
+    uint32_t hash = 2166136261U;
+    hash = ( hash ^ (uint32_t) p_port ) * 16777619U;
+    hash = ( hash ^ (uint32_t) p_size ) * 16777619U;
+    for ( std::size_t i = 0; i < p_size; ++i )
+        hash = ( hash ^ p_data[ i ] ) * 16777619U;
+    return hash;
+}
+
 unsigned system_exclusive_table::add_entry( const uint8_t * p_data, std::size_t p_size, std::size_t p_port )
 {
-    for ( auto it = m_entries.begin(); it < m_entries.end(); ++it )
+    uint32_t hash = hash_entry( p_data, p_size, p_port );
+    auto range = m_index.equal_range( hash );
+    for ( auto it = range.first; it != range.second; ++it )
 	{
-        const system_exclusive_entry & entry = *it;
+        const system_exclusive_entry & entry = m_entries[ it->second ];
         if ( p_port == entry.m_port && p_size == entry.m_length && !memcmp( p_data, &m_data[ entry.m_offset ], p_size ) )
-            return ((unsigned)(it - m_entries.begin()));
+            return it->second;
 	}
     system_exclusive_entry entry( p_port, m_data.size(), p_size );
     m_data.insert( m_data.end(), p_data, p_data + p_size );
     m_entries.push_back( entry );
-    return ((unsigned)(m_entries.size() - 1));
+    unsigned index = (unsigned)(m_entries.size() - 1);
+    m_index.insert( std::make_pair( hash, index ) );
+    return index;
 }
 
-void system_exclusive_table::get_entry( unsigned p_index, const uint8_t * & p_data, std::size_t & p_size, std::size_t & p_port )
+void system_exclusive_table::get_entry( unsigned p_index, const uint8_t * & p_data, std::size_t & p_size, std::size_t & p_port ) const
 {
 	const system_exclusive_entry & entry = m_entries[ p_index ];
     p_data = &m_data[ entry.m_offset ];
@@ -210,6 +606,27 @@ midi_meta_data_item::midi_meta_data_item(const midi_meta_data_item & p_in)
 	m_value = p_in.m_value;
 }
 
+midi_meta_data_item::midi_meta_data_item(midi_meta_data_item && p_in) noexcept
+    : m_timestamp( p_in.m_timestamp ), m_name( std::move( p_in.m_name ) ), m_value( std::move( p_in.m_value ) )
+{
+}
+
+midi_meta_data_item & midi_meta_data_item::operator = (const midi_meta_data_item & p_in)
+{
+	m_timestamp = p_in.m_timestamp;
+	m_name = p_in.m_name;
+	m_value = p_in.m_value;
+	return *this;
+}
+
+midi_meta_data_item & midi_meta_data_item::operator = (midi_meta_data_item && p_in) noexcept
+{
+	m_timestamp = p_in.m_timestamp;
+	m_name = std::move( p_in.m_name );
+	m_value = std::move( p_in.m_value );
+	return *this;
+}
+
 midi_meta_data_item::midi_meta_data_item(unsigned long p_timestamp, const char * p_name, const char * p_value)
 {
 	m_timestamp = p_timestamp;
@@ -217,6 +634,14 @@ midi_meta_data_item::midi_meta_data_item(unsigned long p_timestamp, const char *
 	m_value = p_value;
 }
 
+midi_meta_data_item::midi_meta_data_item(unsigned long p_timestamp, const char * p_name, const char * p_value, std::size_t p_value_length)
+{
+	m_timestamp = p_timestamp;
+	m_name = p_name;
+	const char * value_end = (const char *) memchr( p_value, 0, p_value_length );
+	m_value.assign( p_value, value_end ? value_end : p_value + p_value_length );
+}
+
 void midi_meta_data::add_item( const midi_meta_data_item & p_item )
 {
     m_data.push_back( p_item );
@@ -242,7 +667,7 @@ bool midi_meta_data::get_item( const char * p_name, midi_meta_data_item & p_out
 	return false;
 }
 
-bool midi_meta_data::get_bitmap( std::vector<uint8_t> & p_out )
+bool midi_meta_data::get_bitmap( std::vector<uint8_t> & p_out ) const
 {
     p_out = m_bitmap;
     return p_out.size() != 0;
@@ -278,16 +703,10 @@ void midi_container::encode_delta( std::vector<uint8_t> & p_out, unsigned long d
     p_out.push_back( (unsigned char)( delta & 0x7F ) );
 }
 
-unsigned long midi_container::timestamp_to_ms( unsigned long p_timestamp, unsigned long p_subsong ) const
+unsigned midi_container::get_initial_tempo( unsigned long p_subsong ) const
 {
-	unsigned long timestamp_ms = 0;
-	unsigned long timestamp = 0;
-    std::size_t tempo_index = 0;
 	unsigned current_tempo = 500000;
 
-    unsigned half_dtx = m_dtx * 500;
-    unsigned p_dtx = half_dtx * 2;
-
     unsigned long subsong_count = m_tempo_map.size();
 
 	if ( p_subsong && subsong_count )
@@ -303,26 +722,43 @@ unsigned long midi_container::timestamp_to_ms( unsigned long p_timestamp, unsign
 		}
 	}
 
-	if ( p_subsong < subsong_count )
-	{
-		const tempo_map & m_entries = m_tempo_map[ p_subsong ];
+	return current_tempo;
+}
 
-        std::size_t tempo_count = m_entries.get_count();
+unsigned long midi_container::timestamp_to_ms( unsigned long p_timestamp, unsigned long p_subsong ) const
+{
+	unsigned current_tempo = get_initial_tempo( p_subsong );
 
-		while ( tempo_index < tempo_count && timestamp + p_timestamp >= m_entries[ tempo_index ].m_timestamp )
-		{
-			unsigned long delta = m_entries[ tempo_index ].m_timestamp - timestamp;
-            timestamp_ms += ((uint64_t)current_tempo * (uint64_t)delta + half_dtx) / p_dtx;
-			current_tempo = m_entries[ tempo_index ].m_tempo;
-			++tempo_index;
-			timestamp += delta;
-			p_timestamp -= delta;
-		}
-	}
+	if ( p_subsong < m_tempo_map.size() )
+		return m_tempo_map[ p_subsong ].timestamp_to_ms( p_timestamp, m_dtx, current_tempo );
 
-    timestamp_ms += ((uint64_t)current_tempo * (uint64_t)p_timestamp + half_dtx) / p_dtx;
+    unsigned half_dtx = m_dtx * 500;
+    unsigned p_dtx = half_dtx * 2;
 
-	return timestamp_ms;
+    return tempo_ticks_to_ms( current_tempo, p_timestamp, half_dtx, p_dtx );
+}
+
+unsigned long midi_container::timestamp_to_samples( unsigned long p_timestamp, unsigned long p_subsong, unsigned p_sample_rate ) const
+{
+    return get_tempo_cursor( p_subsong, p_sample_rate ).timestamp_to_samples( p_timestamp );
+}
+
+tempo_map_cursor midi_container::get_tempo_cursor( unsigned long p_subsong, unsigned p_sample_rate /* = 0 */ ) const
+{
+	const tempo_map * map = p_subsong < m_tempo_map.size() ? &m_tempo_map[ p_subsong ] : 0;
+	return tempo_map_cursor( map, m_dtx, get_initial_tempo( p_subsong ), p_sample_rate );
+}
+
+midi_container::midi_container( midi_memory_resource * p_resource )
+    : m_resource( p_resource ? p_resource : midi_memory_resource::get_default() ),
+      m_tracks( midi_allocator<midi_track>( m_resource ) )
+{
+    m_device_names.resize( 16 );
+}
+
+midi_memory_resource * midi_container::get_memory_resource() const
+{
+    return m_resource;
 }
 
 void midi_container::initialize( unsigned p_form, unsigned p_dtx )
@@ -334,6 +770,7 @@ void midi_container::initialize( unsigned p_form, unsigned p_dtx )
         m_channel_mask.resize( 1 );
 		m_channel_mask[ 0 ] = 0;
         m_tempo_map.resize( 1 );
+        m_tempo_map[ 0 ].set_division( p_dtx );
         m_timestamp_end.resize( 1 );
 		m_timestamp_end[ 0 ] = 0;
         m_timestamp_loop_start.resize( 1 );
@@ -342,6 +779,21 @@ void midi_container::initialize( unsigned p_form, unsigned p_dtx )
 }
 
 void midi_container::add_track( const midi_track & p_track )
+{
+    m_tracks.push_back( midi_track( p_track, m_resource ) );
+    scan_added_track();
+}
+
+void midi_container::add_track( midi_track && p_track )
+{
+    if ( p_track.get_memory_resource()->is_equal( *m_resource ) )
+        m_tracks.push_back( std::move( p_track ) );
+    else
+        m_tracks.push_back( midi_track( p_track, m_resource ) );
+    scan_added_track();
+}
+
+void midi_container::scan_added_track()
 {
 	unsigned i;
 	unsigned long port_number = 0;
@@ -349,11 +801,11 @@ void midi_container::add_track( const midi_track & p_track )
     std::vector<uint8_t> data;
     std::string device_name;
 
-    m_tracks.push_back( p_track );
+    const midi_track & track = m_tracks.back();
 
-	for ( i = 0; i < p_track.get_count(); ++i )
+	for ( i = 0; i < track.get_count(); ++i )
 	{
-		const midi_event & event = p_track[ i ];
+		const midi_event & event = track[ i ];
 		if ( event.m_type == midi_event::extended && event.get_data_count() >= 5 &&
 			event.m_data[ 0 ] == 0xFF && event.m_data[ 1 ] == 0x51 )
 		{
@@ -362,6 +814,7 @@ void midi_container::add_track( const midi_track & p_track )
 			else
 			{
                 m_tempo_map.resize( m_tracks.size() );
+                m_tempo_map[ m_tracks.size() - 1 ].set_division( m_dtx );
                 m_tempo_map[ m_tracks.size() - 1 ].add_tempo( tempo, event.m_timestamp );
 			}
 		}
@@ -414,12 +867,12 @@ void midi_container::add_track( const midi_track & p_track )
 		}
 	}
 
-	if ( i && m_form != 2 && p_track[ i - 1 ].m_timestamp > m_timestamp_end[ 0 ] )
-		m_timestamp_end[ 0 ] = p_track[ i - 1 ].m_timestamp;
+	if ( i && m_form != 2 && track[ i - 1 ].m_timestamp > m_timestamp_end[ 0 ] )
+		m_timestamp_end[ 0 ] = track[ i - 1 ].m_timestamp;
 	else if ( m_form == 2 )
 	{
 		if ( i )
-            m_timestamp_end.push_back( p_track[ i - 1 ].m_timestamp );
+            m_timestamp_end.push_back( track[ i - 1 ].m_timestamp );
 		else
             m_timestamp_end.push_back( (unsigned)0 );
 	}
@@ -439,6 +892,7 @@ void midi_container::add_track_event( std::size_t p_track_index, const midi_even
 		else
 		{
             m_tempo_map.resize( m_tracks.size() );
+			m_tempo_map[ p_track_index ].set_division( m_dtx );
 			m_tempo_map[ p_track_index ].add_tempo( tempo, p_event.m_timestamp );
 		}
 	}
@@ -472,7 +926,7 @@ void midi_container::merge_tracks( const midi_container & p_source )
 
 void midi_container::set_track_count( unsigned count )
 {
-    m_tracks.resize( count );
+    m_tracks.resize( count, midi_track( m_resource ) );
 }
 
 void midi_container::set_extra_meta_data( const midi_meta_data & p_data )
@@ -526,31 +980,53 @@ void midi_container::apply_hackfix( unsigned hack )
 
 void midi_container::serialize_as_stream( unsigned long subsong, std::vector<midi_stream_event> & p_stream, system_exclusive_table & p_system_exclusive, unsigned long & loop_start, unsigned long & loop_end, unsigned clean_flags ) const
 {
-    std::vector<uint8_t> data;
-    std::vector<std::size_t> track_positions;
-    std::vector<uint8_t> port_numbers;
-    std::vector<std::string> device_names;
-    std::size_t track_count = m_tracks.size();
-    
-    unsigned long tick_loop_start = get_timestamp_loop_start(subsong);
-    unsigned long tick_loop_end = get_timestamp_loop_end(subsong);
-    unsigned long local_loop_start = ~0UL;
-    unsigned long local_loop_end = ~0UL;
+    serialize_as_stream( subsong, p_stream, p_system_exclusive, loop_start, loop_end, clean_flags, 0 );
+}
+
+void midi_container::serialize_as_stream( unsigned long subsong, std::vector<midi_stream_event> & p_stream, system_exclusive_table & p_system_exclusive, unsigned long & loop_start, unsigned long & loop_end, unsigned clean_flags, unsigned p_sample_rate ) const
+{
+    std::size_t stream_offset = p_stream.size();
+
+    midi_stream_cursor cursor( *this, subsong, p_system_exclusive, clean_flags, p_sample_rate );
+
+    while ( !cursor.is_finished() )
+        cursor.read( p_stream, 4096 );
+
+    loop_start = cursor.get_loop_start();
+    loop_end = cursor.get_loop_end();
+
+    if ( loop_start != ~0UL ) loop_start += stream_offset;
+    if ( loop_end != ~0UL ) loop_end += stream_offset;
+}
+
+midi_stream_cursor::midi_stream_cursor( const midi_container & p_container, unsigned long p_subsong, system_exclusive_table & p_system_exclusive, unsigned p_clean_flags, unsigned p_sample_rate /* = 0 */ )
+    : m_container( p_container ), m_system_exclusive( p_system_exclusive ),
+      m_tempo_cursor( p_container.get_tempo_cursor( p_container.m_form == 2 ? p_subsong : 0, p_sample_rate ) ),
+      m_sample_frames( p_sample_rate != 0 )
+{
+    const midi_container::track_list & tracks = m_container.m_tracks;
+    std::size_t track_count = tracks.size();
+
+    m_tick_loop_start = m_container.get_timestamp_loop_start( p_subsong );
+    m_tick_loop_end = m_container.get_timestamp_loop_end( p_subsong );
+    m_loop_start = ~0UL;
+    m_loop_end = ~0UL;
+    m_position = 0;
 
-    track_positions.resize( track_count, 0 );
-    port_numbers.resize( track_count, 0 );
-    device_names.resize( track_count );
+    m_track_positions.resize( track_count, 0 );
+    m_port_numbers.resize( track_count, 0 );
+    m_device_names.resize( track_count );
 
-	bool clean_emidi = !!( clean_flags & clean_flag_emidi );
-	bool clean_instruments = !!( clean_flags & clean_flag_instruments );
-	bool clean_banks = !!( clean_flags & clean_flag_banks );
+	bool clean_emidi = !!( p_clean_flags & midi_container::clean_flag_emidi );
+	m_clean_instruments = !!( p_clean_flags & midi_container::clean_flag_instruments );
+	m_clean_banks = !!( p_clean_flags & midi_container::clean_flag_banks );
 
 	if ( clean_emidi )
 	{
 		for ( unsigned i = 0; i < track_count; ++i )
 		{
 			bool skip_track = false;
-			const midi_track & track = m_tracks[ i ];
+			const midi_track & track = tracks[ i ];
 			for ( unsigned j = 0; j < track.get_count(); ++j )
 			{
 				const midi_event & event = track[ j ];
@@ -566,244 +1042,453 @@ void midi_container::serialize_as_stream( unsigned long subsong, std::vector<mid
 			}
 			if ( skip_track )
 			{
-				track_positions[ i ] = track.get_count();
+				m_track_positions[ i ] = track.get_count();
 			}
 		}
 	}
 
-	if ( m_form == 2 )
+	if ( m_container.m_form == 2 )
 	{
 		for ( unsigned long i = 0; i < track_count; ++i )
 		{
-			if ( i != subsong ) track_positions[ i ] = m_tracks[ i ].get_count();
+			if ( i != p_subsong ) m_track_positions[ i ] = tracks[ i ].get_count();
 		}
 	}
 
-	for (;;)
+    /* Min-heap of ( next timestamp, track index ); equal timestamps pop the lower track first */
+    m_merge_heap.reserve( track_count );
+	for ( std::size_t i = 0; i < track_count; ++i )
 	{
-        unsigned long next_timestamp = ~0UL;
-        std::size_t next_track = 0;
-		for ( unsigned i = 0; i < track_count; ++i )
-		{
-			if ( track_positions[ i ] >= m_tracks[ i ].get_count() ) continue;
-			if ( m_tracks[ i ][ track_positions[ i ] ].m_timestamp < next_timestamp )
-			{
-				next_timestamp = m_tracks[ i ][ track_positions[ i ] ].m_timestamp;
-				next_track = i;
-			}
-		}
-        if ( next_timestamp == ~0UL ) break;
+		if ( m_track_positions[ i ] < tracks[ i ].get_count() )
+            m_merge_heap.push_back( merge_entry( tracks[ i ][ m_track_positions[ i ] ].m_timestamp, i ) );
+	}
+    std::make_heap( m_merge_heap.begin(), m_merge_heap.end(), std::greater<merge_entry>() );
+}
 
-		bool filtered = false;
+unsigned long midi_stream_cursor::get_time( unsigned long p_timestamp )
+{
+    return m_sample_frames ? m_tempo_cursor.timestamp_to_samples( p_timestamp ) : m_tempo_cursor.timestamp_to_ms( p_timestamp );
+}
 
-		if ( clean_instruments || clean_banks )
+void midi_stream_cursor::resolve_device_name( std::size_t p_track, unsigned p_channel )
+{
+	if ( m_device_names[ p_track ].length() )
+	{
+		unsigned long i, j;
+        for ( i = 0, j = m_container.m_device_names[ p_channel ].size(); i < j; ++i )
 		{
-			const midi_event & event = m_tracks[ next_track ][ track_positions[ next_track ] ];
-			if ( clean_instruments && event.m_type == midi_event::program_change ) filtered = true;
-			else if ( clean_banks && event.m_type == midi_event::control_change &&
-				( event.m_data[ 0 ] == 0x00 || event.m_data[ 0 ] == 0x20 ) ) filtered = true;
+            if ( !strcmp( m_container.m_device_names[ p_channel ][ i ].c_str(), m_device_names[ p_track ].c_str() ) ) break;
 		}
+		m_port_numbers[ p_track ] = (uint8_t) i;
+        m_device_names[ p_track ].clear();
+        m_container.limit_port_number( m_port_numbers[ p_track ] );
+	}
+}
 
-		if ( !filtered )
-		{
-			unsigned long tempo_track = 0;
-			if ( m_form == 2 && subsong ) tempo_track = subsong;
+void midi_stream_cursor::step( std::vector<midi_stream_event> & p_out )
+{
+    std::pop_heap( m_merge_heap.begin(), m_merge_heap.end(), std::greater<merge_entry>() );
+    std::size_t next_track = m_merge_heap.back().second;
+    m_merge_heap.pop_back();
 
-			const midi_event & event = m_tracks[ next_track ][ track_positions[ next_track ] ];
+    const midi_track & track = m_container.m_tracks[ next_track ];
+    const midi_event & event = track[ m_track_positions[ next_track ] ];
 
-            if ( local_loop_start == ~0UL && event.m_timestamp >= tick_loop_start )
-                local_loop_start = p_stream.size();
-            if ( local_loop_end == ~0UL && event.m_timestamp > tick_loop_end )
-                local_loop_end = p_stream.size();
-            
-			unsigned long timestamp_ms = timestamp_to_ms( event.m_timestamp, tempo_track );
-			if ( event.m_type != midi_event::extended )
+	bool filtered = false;
+
+	if ( m_clean_instruments && event.m_type == midi_event::program_change ) filtered = true;
+	else if ( m_clean_banks && event.m_type == midi_event::control_change &&
+		( event.m_data[ 0 ] == 0x00 || event.m_data[ 0 ] == 0x20 ) ) filtered = true;
+
+	if ( !filtered )
+	{
+        if ( m_loop_start == ~0UL && event.m_timestamp >= m_tick_loop_start )
+            m_loop_start = m_position;
+        if ( m_loop_end == ~0UL && event.m_timestamp > m_tick_loop_end )
+            m_loop_end = m_position;
+
+		unsigned long timestamp = get_time( event.m_timestamp );
+		if ( event.m_type != midi_event::extended )
+		{
+            resolve_device_name( next_track, event.m_channel );
+
+			uint32_t event_code = ( ( event.m_type + 8 ) << 4 ) + event.m_channel;
+			if ( event.m_data_count >= 1 ) event_code += event.m_data[ 0 ] << 8;
+			if ( event.m_data_count >= 2 ) event_code += event.m_data[ 1 ] << 16;
+			event_code += m_port_numbers[ next_track ] << 24;
+            p_out.push_back( midi_stream_event( timestamp, event_code ) );
+            ++m_position;
+		}
+		else
+		{
+            std::size_t data_count = event.get_data_count();
+			if ( data_count >= 3 && event.m_data[ 0 ] == 0xF0 )
 			{
-				if ( device_names[ next_track ].length() )
+                resolve_device_name( next_track, event.m_channel );
+
+				if ( event.m_data[ data_count - 1 ] == 0xF7 )
 				{
-					unsigned long i, j;
-                    for ( i = 0, j = m_device_names[ event.m_channel ].size(); i < j; ++i )
-					{
-                        if ( !strcmp( m_device_names[ event.m_channel ][ i ].c_str(), device_names[ next_track ].c_str() ) ) break;
-					}
-					port_numbers[ next_track ] = (uint8_t) i;
-                    device_names[ next_track ].clear();
-                    limit_port_number( port_numbers[ next_track ] );
+                    uint32_t system_exclusive_index = m_system_exclusive.add_entry( event.m_data, data_count, m_port_numbers[ next_track ] );
+                    p_out.push_back( midi_stream_event( timestamp, system_exclusive_index | 0x80000000 ) );
+                    ++m_position;
 				}
-
-				uint32_t event_code = ( ( event.m_type + 8 ) << 4 ) + event.m_channel;
-				if ( event.m_data_count >= 1 ) event_code += event.m_data[ 0 ] << 8;
-				if ( event.m_data_count >= 2 ) event_code += event.m_data[ 1 ] << 16;
-				event_code += port_numbers[ next_track ] << 24;
-                p_stream.push_back( midi_stream_event( timestamp_ms, event_code ) );
 			}
-			else
+			else if ( data_count >= 3 && event.m_data[ 0 ] == 0xFF )
 			{
-                std::size_t data_count = event.get_data_count();
-				if ( data_count >= 3 && event.m_data[ 0 ] == 0xF0 )
+                if ( event.m_data[ 1 ] == 4 || event.m_data[ 1 ] == 9 )
 				{
-					if ( device_names[ next_track ].length() )
-					{
-						unsigned long i, j;
-                        for ( i = 0, j = m_device_names[ event.m_channel ].size(); i < j; ++i )
-						{
-                            if ( !strcmp( m_device_names[ event.m_channel ][ i ].c_str(), device_names[ next_track ].c_str() ) ) break;
-						}
-						port_numbers[ next_track ] = (uint8_t) i;
-                        device_names[ next_track ].clear();
-                        limit_port_number( port_numbers[ next_track ] );
-					}
-
-                    data.resize( data_count );
-                    event.copy_data( &data[0], 0, data_count );
-					if ( data[ data_count - 1 ] == 0xF7 )
-					{
-                        uint32_t system_exclusive_index = p_system_exclusive.add_entry( &data[0], data_count, port_numbers[ next_track ] );
-                        p_stream.push_back( midi_stream_event( timestamp_ms, system_exclusive_index | 0x80000000 ) );
-					}
+                    m_device_names[ next_track ].assign( event.m_data + 2, event.m_data + data_count );
+                    std::transform( m_device_names[ next_track ].begin(), m_device_names[ next_track ].end(), m_device_names[ next_track ].begin(), ::tolower );
 				}
-				else if ( data_count >= 3 && event.m_data[ 0 ] == 0xFF )
+				else if ( event.m_data[ 1 ] == 0x21 )
 				{
-                    if ( event.m_data[ 1 ] == 4 || event.m_data[ 1 ] == 9 )
-					{
-						unsigned long _data_count = event.get_data_count() - 2;
-                        data.resize( _data_count );
-                        event.copy_data( &data[0], 2, _data_count );
-                        device_names[ next_track ].clear();
-                        device_names[ next_track ].assign( data.begin(), data.begin() + _data_count );
-                        std::transform( device_names[ next_track ].begin(), device_names[ next_track ].end(), device_names[ next_track ].begin(), ::tolower );
-					}
-					else if ( event.m_data[ 1 ] == 0x21 )
-					{
-						port_numbers[ next_track ] = event.m_data[ 2 ];
-                        device_names[ next_track ].clear();
-                        limit_port_number( port_numbers[ next_track ] );
-					}
+					m_port_numbers[ next_track ] = event.m_data[ 2 ];
+                    m_device_names[ next_track ].clear();
+                    m_container.limit_port_number( m_port_numbers[ next_track ] );
 				}
-				else if ( data_count == 1 && event.m_data[ 0 ] >= 0xF8 )
-				{
-					if ( device_names[ next_track ].length() )
-					{
-						unsigned long i, j;
-						for ( i = 0, j = m_device_names[ event.m_channel ].size(); i < j; ++i )
-						{
-							if ( !strcmp( m_device_names[ event.m_channel ][ i ].c_str(), device_names[ next_track ].c_str() ) ) break;
-						}
-						port_numbers[ next_track ] = (uint8_t) i;
-						device_names[ next_track ].clear();
-						limit_port_number( port_numbers[ next_track ] );
-					}
+			}
+			else if ( data_count == 1 && event.m_data[ 0 ] >= 0xF8 )
+			{
+                resolve_device_name( next_track, event.m_channel );
 
-					uint32_t event_code = port_numbers[ next_track ] << 24;
-					event_code += event.m_data[ 0 ];
-					p_stream.push_back( midi_stream_event( timestamp_ms, event_code ) );
-				}
+				uint32_t event_code = m_port_numbers[ next_track ] << 24;
+				event_code += event.m_data[ 0 ];
+				p_out.push_back( midi_stream_event( timestamp, event_code ) );
+                ++m_position;
 			}
 		}
+	}
 
-		track_positions[ next_track ]++;
+	if ( ++m_track_positions[ next_track ] < track.get_count() )
+	{
+        m_merge_heap.push_back( merge_entry( track[ m_track_positions[ next_track ] ].m_timestamp, next_track ) );
+        std::push_heap( m_merge_heap.begin(), m_merge_heap.end(), std::greater<merge_entry>() );
 	}
-    
-    loop_start = local_loop_start;
-    loop_end = local_loop_end;
 }
 
-void midi_container::serialize_as_standard_midi_file( std::vector<uint8_t> & p_midi_file ) const
+std::size_t midi_stream_cursor::read( std::vector<midi_stream_event> & p_out, std::size_t p_count )
+{
+    std::size_t start = p_out.size();
+    while ( m_merge_heap.size() && p_out.size() - start < p_count )
+        step( p_out );
+    return p_out.size() - start;
+}
+
+std::size_t midi_stream_cursor::read_until( std::vector<midi_stream_event> & p_out, unsigned long p_timestamp )
+{
+    std::size_t start = p_out.size();
+    while ( m_merge_heap.size() && get_time( m_merge_heap.front().first ) < p_timestamp )
+        step( p_out );
+    return p_out.size() - start;
+}
+
+bool midi_stream_cursor::is_finished() const
+{
+    return !m_merge_heap.size();
+}
+
+unsigned long midi_stream_cursor::get_position() const
+{
+    return m_position;
+}
+
+unsigned long midi_stream_cursor::get_loop_start() const
+{
+    return m_loop_start;
+}
+
+unsigned long midi_stream_cursor::get_loop_end() const
+{
+    return m_loop_end;
+}
+
+static std::size_t get_delta_size( unsigned long delta )
+{
+    std::size_t size = 1;
+    while ( size < 5 && ( delta >> ( 7 * size ) ) ) ++size;
+    return size;
+}
+
+static uint8_t * write_delta( uint8_t * p_out, unsigned long delta )
+{
+	unsigned shift = 7 * 4;
+	while ( shift && !( delta >> shift ) )
+	{
+		shift -= 7;
+	}
+	while (shift > 0)
+	{
+        *p_out++ = (uint8_t)( ( ( delta >> shift ) & 0x7F ) | 0x80 );
+		shift -= 7;
+	}
+    *p_out++ = (uint8_t)( delta & 0x7F );
+    return p_out;
+}
+
+static uint8_t * write_bytes( uint8_t * p_out, const uint8_t * p_data, std::size_t p_count )
+{
+    if ( p_count ) memcpy( p_out, p_data, p_count );
+    return p_out + p_count;
+}
+
+/*
+ * Exact size of a track's MTrk body as written by write_track_body. The
+ * two must make the same running status and length prefix decisions.
+ */
+static std::size_t get_track_body_size( const midi_track & p_track )
+{
+    std::size_t size = 0;
+    unsigned long last_timestamp = 0;
+    unsigned char last_event_code = 0xFF;
+
+    for ( std::size_t i = 0, count = p_track.get_count(); i < count; ++i )
+	{
+        const midi_event event = p_track[ i ];
+        size += get_delta_size( event.m_timestamp - last_timestamp );
+        last_timestamp = event.m_timestamp;
+        if ( event.m_type != midi_event::extended )
+		{
+            const unsigned char event_code = ( ( event.m_type + 8 ) << 4 ) + event.m_channel;
+            if ( event_code != last_event_code )
+			{
+                ++size;
+                last_event_code = event_code;
+			}
+            size += event.m_data_count;
+		}
+        else
+		{
+            std::size_t data_count = event.m_data_count;
+            if ( data_count >= 1 && event.m_data[ 0 ] == 0xF0 )
+                size += 1 + get_delta_size( data_count - 1 ) + data_count - 1;
+            else if ( data_count >= 2 && event.m_data[ 0 ] == 0xFF )
+                size += 2 + get_delta_size( data_count - 2 ) + data_count - 2;
+            else
+                size += data_count;
+		}
+	}
+
+    return size;
+}
+
+enum
+{
+    /* Delta, status, meta type and length */
+    max_event_prefix_size = 5 + 2 + 5
+};
+
+/*
+ * Writes everything an event encodes to ahead of its payload and points
+ * p_payload at the bytes that follow, which are still in track storage.
+ */
+static uint8_t * write_event_prefix( const midi_event & p_event, unsigned long & p_last_timestamp, unsigned char & p_last_event_code, uint8_t * p_out, const uint8_t * & p_payload, std::size_t & p_payload_count )
+{
+    p_out = write_delta( p_out, p_event.m_timestamp - p_last_timestamp );
+    p_last_timestamp = p_event.m_timestamp;
+    if ( p_event.m_type != midi_event::extended )
+	{
+        const unsigned char event_code = ( ( p_event.m_type + 8 ) << 4 ) + p_event.m_channel;
+        if ( event_code != p_last_event_code )
+		{
+            *p_out++ = event_code;
+            p_last_event_code = event_code;
+		}
+        p_payload = p_event.m_data;
+        p_payload_count = p_event.m_data_count;
+	}
+    else
+	{
+        std::size_t data_count = p_event.m_data_count;
+        if ( data_count >= 1 && p_event.m_data[ 0 ] == 0xF0 )
+		{
+            *p_out++ = 0xF0;
+            p_out = write_delta( p_out, data_count - 1 );
+            p_payload = p_event.m_data + 1;
+            p_payload_count = data_count - 1;
+		}
+        else if ( data_count >= 2 && p_event.m_data[ 0 ] == 0xFF )
+		{
+            *p_out++ = 0xFF;
+            *p_out++ = p_event.m_data[ 1 ];
+            p_out = write_delta( p_out, data_count - 2 );
+            p_payload = p_event.m_data + 2;
+            p_payload_count = data_count - 2;
+		}
+        else
+		{
+            p_payload = p_event.m_data;
+            p_payload_count = data_count;
+		}
+	}
+    return p_out;
+}
+
+static uint8_t * write_track_body( const midi_track & p_track, uint8_t * p_out )
+{
+    unsigned long last_timestamp = 0;
+    unsigned char last_event_code = 0xFF;
+
+    for ( std::size_t i = 0, count = p_track.get_count(); i < count; ++i )
+	{
+        const uint8_t * payload;
+        std::size_t payload_count;
+        p_out = write_event_prefix( p_track[ i ], last_timestamp, last_event_code, p_out, payload, payload_count );
+        p_out = write_bytes( p_out, payload, payload_count );
+	}
+
+    return p_out;
+}
+
+static uint8_t * write_chunk_header( uint8_t * p_out, const char * p_signature, uint32_t p_length )
+{
+    p_out = write_bytes( p_out, (const uint8_t *) p_signature, 4 );
+    *p_out++ = (uint8_t)( p_length >> 24 );
+    *p_out++ = (uint8_t)( p_length >> 16 );
+    *p_out++ = (uint8_t)( p_length >> 8 );
+    *p_out++ = (uint8_t) p_length;
+    return p_out;
+}
+
+static uint8_t * write_file_header( uint8_t * p_out, unsigned p_form, std::size_t p_track_count, unsigned p_dtx )
+{
+    p_out = write_chunk_header( p_out, "MThd", 6 );
+    *p_out++ = 0;
+    *p_out++ = (uint8_t) p_form;
+    *p_out++ = (uint8_t)( p_track_count >> 8 );
+    *p_out++ = (uint8_t) p_track_count;
+    *p_out++ = (uint8_t)( p_dtx >> 8 );
+    *p_out++ = (uint8_t) p_dtx;
+    return p_out;
+}
+
+void midi_container::serialize_as_standard_midi_file( std::vector<uint8_t> & p_midi_file, midi_parallel_executor * p_executor ) const
 {
     if ( !m_tracks.size() ) return;
 
-    std::vector<uint8_t> data;
+    std::size_t track_count = m_tracks.size();
+    std::vector<std::size_t> track_sizes( track_count );
 
-    const char signature[] = "MThd";
-    p_midi_file.insert( p_midi_file.end(), signature, signature + 4 );
-    p_midi_file.push_back( 0 );
-    p_midi_file.push_back( 0 );
-    p_midi_file.push_back( 0 );
-    p_midi_file.push_back( 6 );
-    p_midi_file.push_back( 0 );
-    p_midi_file.push_back( m_form );
-    p_midi_file.push_back( (uint8_t) (m_tracks.size() >> 8) );
-    p_midi_file.push_back( (uint8_t) m_tracks.size() );
-    p_midi_file.push_back( (m_dtx >> 8) );
-    p_midi_file.push_back( m_dtx );
-
-    for ( unsigned i = 0; i < m_tracks.size(); ++i )
+    if ( p_executor && track_count > 1 )
 	{
-		const midi_track & track = m_tracks[ i ];
-		unsigned long last_timestamp = 0;
-		unsigned char last_event_code = 0xFF;
-        std::size_t length_offset;
+        p_executor->run( track_count, [&]( std::size_t i )
+        {
+            track_sizes[ i ] = get_track_body_size( m_tracks[ i ] );
+        } );
+	}
+    else
+	{
+        for ( std::size_t i = 0; i < track_count; ++i )
+            track_sizes[ i ] = get_track_body_size( m_tracks[ i ] );
+	}
 
-        const char _signature[] = "MTrk";
-        p_midi_file.insert( p_midi_file.end(), _signature, _signature + 4 );
+    std::vector<std::size_t> track_offsets( track_count );
+    std::size_t file_size = 14;
 
-        length_offset = p_midi_file.size();
-        p_midi_file.push_back( 0 );
-        p_midi_file.push_back( 0 );
-        p_midi_file.push_back( 0 );
-        p_midi_file.push_back( 0 );
+    for ( std::size_t i = 0; i < track_count; ++i )
+	{
+        track_offsets[ i ] = file_size;
+        file_size += 8 + track_sizes[ i ];
+	}
 
-		for ( unsigned j = 0; j < track.get_count(); ++j )
+    std::size_t file_offset = p_midi_file.size();
+    p_midi_file.resize( file_offset + file_size );
+
+    uint8_t * file = &p_midi_file[ file_offset ];
+
+    write_file_header( file, m_form, track_count, m_dtx );
+
+    /* Every track's position is known, so each one is written in place */
+    if ( p_executor && track_count > 1 )
+	{
+        p_executor->run( track_count, [&]( std::size_t i )
+        {
+            uint8_t * out = write_chunk_header( file + track_offsets[ i ], "MTrk", (uint32_t) track_sizes[ i ] );
+            write_track_body( m_tracks[ i ], out );
+        } );
+	}
+    else
+	{
+        for ( std::size_t i = 0; i < track_count; ++i )
 		{
-			const midi_event & event = track[ j ];
-			encode_delta( p_midi_file, event.m_timestamp - last_timestamp );
-			last_timestamp = event.m_timestamp;
-			if ( event.m_type != midi_event::extended )
+            uint8_t * out = write_chunk_header( file + track_offsets[ i ], "MTrk", (uint32_t) track_sizes[ i ] );
+            write_track_body( m_tracks[ i ], out );
+		}
+	}
+}
+
+bool midi_container::serialize_as_standard_midi_file( const midi_write_callback & p_write ) const
+{
+    if ( !m_tracks.size() ) return true;
+
+    enum { buffer_size = 65536 };
+
+    std::vector<uint8_t> buffer( buffer_size );
+    uint8_t * const begin = &buffer[ 0 ];
+    uint8_t * const end = begin + buffer_size;
+
+    uint8_t * out = write_file_header( begin, m_form, m_tracks.size(), m_dtx );
+
+    for ( std::size_t i = 0; i < m_tracks.size(); ++i )
+	{
+        const midi_track & track = m_tracks[ i ];
+
+        if ( end - out < 8 )
+		{
+            if ( !p_write( begin, out - begin ) ) return false;
+            out = begin;
+		}
+        out = write_chunk_header( out, "MTrk", (uint32_t) get_track_body_size( track ) );
+
+        unsigned long last_timestamp = 0;
+        unsigned char last_event_code = 0xFF;
+
+        for ( std::size_t j = 0, count = track.get_count(); j < count; ++j )
+		{
+            if ( end - out < max_event_prefix_size )
 			{
-				const unsigned char event_code = ( ( event.m_type + 8 ) << 4 ) + event.m_channel;
-				if ( event_code != last_event_code )
-				{
-                    p_midi_file.push_back( event_code );
-					last_event_code = event_code;
-				}
-                p_midi_file.insert( p_midi_file.end(), event.m_data, event.m_data + event.m_data_count );
+                if ( !p_write( begin, out - begin ) ) return false;
+                out = begin;
 			}
-			else
+
+            const uint8_t * payload;
+            std::size_t payload_count;
+            out = write_event_prefix( track[ j ], last_timestamp, last_event_code, out, payload, payload_count );
+
+            if ( (std::size_t)( end - out ) >= payload_count )
 			{
-                std::size_t data_count = event.get_data_count();
-				if ( data_count >= 1 )
-				{
-					if ( event.m_data[ 0 ] == 0xF0 )
-					{
-						--data_count;
-                        p_midi_file.push_back( 0xF0 );
-						encode_delta( p_midi_file, data_count );
-						if ( data_count )
-						{
-							data.resize( data_count );
-							event.copy_data( &data[0], 1, data_count );
-							p_midi_file.insert( p_midi_file.end(), data.begin(), data.begin() + data_count );
-						}
-					}
-					else if ( event.m_data[ 0 ] == 0xFF && data_count >= 2 )
-					{
-						data_count -= 2;
-                        p_midi_file.push_back( 0xFF );
-                        p_midi_file.push_back( event.m_data[ 1 ] );
-						encode_delta( p_midi_file, data_count );
-						if ( data_count )
-						{
-							data.resize( data_count );
-							event.copy_data( &data[0], 2, data_count );
-							p_midi_file.insert( p_midi_file.end(), data.begin(), data.begin() + data_count );
-						}
-					}
-					else
-					{
-						data.resize( data_count );
-						event.copy_data( &data[0], 1, data_count );
-						p_midi_file.insert( p_midi_file.end(), data.begin(), data.begin() + data_count );
-					}
-				}
+                out = write_bytes( out, payload, payload_count );
+			}
+            else
+			{
+                /* Too big for what is left of the buffer; pass it through */
+                if ( !p_write( begin, out - begin ) ) return false;
+                out = begin;
+                if ( !p_write( payload, payload_count ) ) return false;
 			}
 		}
-
-        std::size_t track_length = p_midi_file.size() - length_offset - 4;
-		p_midi_file[ length_offset + 0 ] = (unsigned char)( track_length >> 24 );
-		p_midi_file[ length_offset + 1 ] = (unsigned char)( track_length >> 16 );
-		p_midi_file[ length_offset + 2 ] = (unsigned char)( track_length >> 8 );
-		p_midi_file[ length_offset + 3 ] = (unsigned char)track_length;
 	}
+
+    return out == begin || p_write( begin, out - begin );
+}
+
+bool midi_container::serialize_as_standard_midi_file( int p_fd ) const
+{
+    return serialize_as_standard_midi_file( [p_fd]( const uint8_t * p_data, std::size_t p_size ) -> bool
+    {
+        while ( p_size )
+		{
+#ifdef _WIN32
+            int written = _write( p_fd, p_data, (unsigned) std::min<std::size_t>( p_size, 0x40000000 ) );
+#else
+            ssize_t written = write( p_fd, p_data, p_size );
+            if ( written < 0 && errno == EINTR ) continue;
+#endif
+            if ( written <= 0 ) return false;
+            p_data += written;
+            p_size -= written;
+		}
+        return true;
+    } );
 }
 
 void midi_container::promote_to_type1()
@@ -811,11 +1496,11 @@ void midi_container::promote_to_type1()
 	if ( m_form == 0 && m_tracks.size() <= 2 )
 	{
 		bool meter_track_present = false;
-		midi_track new_tracks[17];
-		midi_track original_data_track = m_tracks[ m_tracks.size() - 1 ];
+		std::vector<midi_track> new_tracks( 17, midi_track( m_resource ) );
+		midi_track original_data_track = std::move( m_tracks[ m_tracks.size() - 1 ] );
 		if ( m_tracks.size() > 1 )
 		{
-			new_tracks[0] = m_tracks[0];
+			new_tracks[0] = std::move( m_tracks[0] );
 			meter_track_present = true;
 		}
 
@@ -850,7 +1535,7 @@ void midi_container::promote_to_type1()
 		for ( std::size_t i = 0; i < 17; ++i )
 		{
 			if ( new_tracks[ i ].get_count() > 1 )
-				add_track( new_tracks[ i ] );
+				add_track( std::move( new_tracks[ i ] ) );
 		}
 
 		m_form = 1;
@@ -942,6 +1627,28 @@ unsigned long midi_container::get_timestamp_loop_end( unsigned long subsong, boo
     else return ~0UL;
 }
 
+unsigned long midi_container::get_timestamp_end_samples( unsigned long subsong, unsigned p_sample_rate ) const
+{
+	unsigned long tempo_track = ( m_form == 2 && subsong ) ? subsong : 0;
+	return timestamp_to_samples( get_timestamp_end( subsong ), tempo_track, p_sample_rate );
+}
+
+unsigned long midi_container::get_timestamp_loop_start_samples( unsigned long subsong, unsigned p_sample_rate ) const
+{
+	unsigned long tempo_track = ( m_form == 2 && subsong ) ? subsong : 0;
+	unsigned long timestamp = get_timestamp_loop_start( subsong );
+	if ( timestamp != ~0UL ) return timestamp_to_samples( timestamp, tempo_track, p_sample_rate );
+	else return ~0UL;
+}
+
+unsigned long midi_container::get_timestamp_loop_end_samples( unsigned long subsong, unsigned p_sample_rate ) const
+{
+	unsigned long tempo_track = ( m_form == 2 && subsong ) ? subsong : 0;
+	unsigned long timestamp = get_timestamp_loop_end( subsong );
+	if ( timestamp != ~0UL ) return timestamp_to_samples( timestamp, tempo_track, p_sample_rate );
+	else return ~0UL;
+}
+
 /* TODO: Use iconv or libintl or something to probe for code pages and convert some mess to UTF-8 */
 static void convert_mess_to_utf8( const char * p_src, std::size_t p_src_len, std::string & p_dst )
 {
@@ -965,6 +1672,8 @@ void midi_container::get_meta_data( unsigned long subsong, midi_meta_data & p_ou
 		unsigned long tempo_track = 0;
 		if ( m_form == 2 ) tempo_track = i;
 
+		tempo_map_cursor tempo_cursor = get_tempo_cursor( tempo_track );
+
 		const midi_track & track = m_tracks[ i ];
 		for ( unsigned j = 0; j < track.get_count(); ++j )
 		{
@@ -1002,7 +1711,7 @@ void midi_container::get_meta_data( unsigned long subsong, midi_meta_data & p_ou
 					{
 						type_found = true;
 						type_non_gm_found = true;
-						p_out.add_item( midi_meta_data_item( timestamp_to_ms( event.m_timestamp, tempo_track ), "type", type ) );
+						p_out.add_item( midi_meta_data_item( tempo_cursor.timestamp_to_ms( event.m_timestamp ), "type", type ) );
 					}
 				}
 				else if ( data_count >= 2 && event.m_data[ 0 ] == 0xFF )
@@ -1014,14 +1723,14 @@ void midi_container::get_meta_data( unsigned long subsong, midi_meta_data & p_ou
                         data.resize( data_count );
                         event.copy_data( &data[0], 2, data_count );
                         convert_mess_to_utf8( ( const char * ) &data[0], data_count, convert );
-                        p_out.add_item( midi_meta_data_item( timestamp_to_ms( event.m_timestamp, tempo_track ), "track_marker", convert.c_str() ) );
+                        p_out.add_item( midi_meta_data_item( tempo_cursor.timestamp_to_ms( event.m_timestamp ), "track_marker", convert.c_str() ) );
 						break;
 
 					case 2:
                         data.resize( data_count );
                         event.copy_data( &data[0], 2, data_count );
                         convert_mess_to_utf8( ( const char * ) &data[0], data_count, convert );
-                        p_out.add_item( midi_meta_data_item( timestamp_to_ms( event.m_timestamp, tempo_track ), "copyright", convert.c_str() ) );
+                        p_out.add_item( midi_meta_data_item( tempo_cursor.timestamp_to_ms( event.m_timestamp ), "copyright", convert.c_str() ) );
 						break;
 
 					case 1:
@@ -1029,7 +1738,7 @@ void midi_container::get_meta_data( unsigned long subsong, midi_meta_data & p_ou
                         event.copy_data( &data[0], 2, data_count );
                         convert_mess_to_utf8( ( const char * ) &data[0], data_count, convert );
                         snprintf(temp, 31, "track_text_%02lu", i);
-                        p_out.add_item( midi_meta_data_item( timestamp_to_ms( event.m_timestamp, tempo_track ), temp, convert.c_str() ) );
+                        p_out.add_item( midi_meta_data_item( tempo_cursor.timestamp_to_ms( event.m_timestamp ), temp, convert.c_str() ) );
 						break;
 
 					case 3:
@@ -1038,7 +1747,7 @@ void midi_container::get_meta_data( unsigned long subsong, midi_meta_data & p_ou
                         event.copy_data( &data[0], 2, data_count );
                         convert_mess_to_utf8( ( const char * ) &data[0], data_count, convert );
                         snprintf(temp, 31, "track_name_%02lu", i);
-                        p_out.add_item( midi_meta_data_item( timestamp_to_ms( event.m_timestamp, tempo_track ), temp, convert.c_str() ) );
+                        p_out.add_item( midi_meta_data_item( tempo_cursor.timestamp_to_ms( event.m_timestamp ), temp, convert.c_str() ) );
 						break;
 					}
 				}
@@ -1204,3 +1913,324 @@ void midi_container::scan_for_loops( bool p_xmi_loops, bool p_marker_loops, bool
 		}
 	}
 }
+
+/*
+ * Snapshot layout, all integers in native byte order:
+ *
+ *   "MIDC", version, byte order mark, size of a packed event record
+ *   form, division
+ *   channel masks, end and loop timestamps (count, then values)
+ *   tempo maps (count; per map: entry count, then timestamp and tempo pairs)
+ *   tracks (count; per track: record count, payload size, records, payload)
+ *   port numbers, device names, extra meta data items, meta data bitmap
+ *
+ * Timestamps are stored as 64-bit values, with ~0 kept as ~0 so loop
+ * points survive a change in the width of unsigned long.
+ */
+enum
+{
+    snapshot_version = 1,
+    snapshot_byte_order = 0x01020304
+};
+
+static const uint8_t snapshot_signature[4] = { 'M', 'I', 'D', 'C' };
+
+static void snapshot_write( std::vector<uint8_t> & p_out, const void * p_data, std::size_t p_size )
+{
+    const uint8_t * data = (const uint8_t *) p_data;
+    p_out.insert( p_out.end(), data, data + p_size );
+}
+
+static void snapshot_write_uint32( std::vector<uint8_t> & p_out, uint32_t p_value )
+{
+    snapshot_write( p_out, &p_value, sizeof( p_value ) );
+}
+
+static void snapshot_write_uint64( std::vector<uint8_t> & p_out, uint64_t p_value )
+{
+    snapshot_write( p_out, &p_value, sizeof( p_value ) );
+}
+
+static void snapshot_write_timestamp( std::vector<uint8_t> & p_out, unsigned long p_value )
+{
+    snapshot_write_uint64( p_out, p_value == ~0UL ? ~(uint64_t)0 : (uint64_t) p_value );
+}
+
+static void snapshot_write_string( std::vector<uint8_t> & p_out, const std::string & p_value )
+{
+    snapshot_write_uint32( p_out, (uint32_t) p_value.size() );
+    snapshot_write( p_out, p_value.data(), p_value.size() );
+}
+
+static void snapshot_write_timestamps( std::vector<uint8_t> & p_out, const std::vector<unsigned long> & p_values )
+{
+    snapshot_write_uint32( p_out, (uint32_t) p_values.size() );
+    for ( std::size_t i = 0; i < p_values.size(); ++i )
+        snapshot_write_timestamp( p_out, p_values[ i ] );
+}
+
+/* Bounds checked cursor over a snapshot; every read fails once one has */
+class snapshot_reader
+{
+    midi_byte_span::const_iterator m_it;
+    midi_byte_span::const_iterator m_end;
+    bool m_valid;
+
+public:
+    explicit snapshot_reader( midi_byte_span const& p_data ) : m_it( p_data.begin() ), m_end( p_data.end() ), m_valid( true ) { }
+
+    bool is_valid() const { return m_valid; }
+    bool at_end() const { return m_it == m_end; }
+
+    const uint8_t * read( std::size_t p_size )
+    {
+        if ( !m_valid || (std::size_t)( m_end - m_it ) < p_size )
+		{
+            m_valid = false;
+            return 0;
+		}
+        const uint8_t * data = m_it;
+        m_it += p_size;
+        return data;
+    }
+
+    bool read( void * p_out, std::size_t p_size )
+    {
+        const uint8_t * data = read( p_size );
+        if ( data && p_size ) memcpy( p_out, data, p_size );
+        return !!data;
+    }
+
+    uint32_t read_uint32()
+    {
+        uint32_t value = 0;
+        read( &value, sizeof( value ) );
+        return value;
+    }
+
+    uint64_t read_uint64()
+    {
+        uint64_t value = 0;
+        read( &value, sizeof( value ) );
+        return value;
+    }
+
+    unsigned long read_timestamp()
+    {
+        uint64_t value = read_uint64();
+        return value == ~(uint64_t)0 ? ~0UL : (unsigned long) value;
+    }
+
+    /* Checks a count against the bytes left before anything is allocated for it */
+    uint32_t read_count( std::size_t p_item_size )
+    {
+        uint32_t count = read_uint32();
+        if ( m_valid && (uint64_t) count * p_item_size > (uint64_t)( m_end - m_it ) ) m_valid = false;
+        return m_valid ? count : 0;
+    }
+
+    bool read_string( std::string & p_out )
+    {
+        uint32_t size = read_count( 1 );
+        const uint8_t * data = read( size );
+        if ( data ) p_out.assign( (const char *) data, size );
+        return !!data;
+    }
+
+    bool read_timestamps( std::vector<unsigned long> & p_out )
+    {
+        p_out.resize( read_count( sizeof( uint64_t ) ) );
+        for ( std::size_t i = 0; i < p_out.size(); ++i )
+            p_out[ i ] = read_timestamp();
+        return m_valid;
+    }
+};
+
+void midi_container::serialize_as_snapshot( std::vector<uint8_t> & p_out ) const
+{
+    snapshot_write( p_out, snapshot_signature, sizeof( snapshot_signature ) );
+    snapshot_write_uint32( p_out, snapshot_version );
+    snapshot_write_uint32( p_out, snapshot_byte_order );
+    snapshot_write_uint32( p_out, (uint32_t) sizeof( midi_track::event_record ) );
+
+    snapshot_write_uint32( p_out, m_form );
+    snapshot_write_uint32( p_out, m_dtx );
+
+    snapshot_write_uint32( p_out, (uint32_t) m_channel_mask.size() );
+    if ( m_channel_mask.size() ) snapshot_write( p_out, &m_channel_mask[0], m_channel_mask.size() * sizeof( uint64_t ) );
+
+    snapshot_write_timestamps( p_out, m_timestamp_end );
+    snapshot_write_timestamps( p_out, m_timestamp_loop_start );
+    snapshot_write_timestamps( p_out, m_timestamp_loop_end );
+
+    snapshot_write_uint32( p_out, (uint32_t) m_tempo_map.size() );
+    for ( std::size_t i = 0; i < m_tempo_map.size(); ++i )
+	{
+        const tempo_map & map = m_tempo_map[ i ];
+        snapshot_write_uint32( p_out, (uint32_t) map.get_count() );
+        for ( std::size_t j = 0; j < map.get_count(); ++j )
+		{
+            snapshot_write_timestamp( p_out, map[ j ].m_timestamp );
+            snapshot_write_uint32( p_out, map[ j ].m_tempo );
+		}
+	}
+
+    snapshot_write_uint32( p_out, (uint32_t) m_tracks.size() );
+    for ( std::size_t i = 0; i < m_tracks.size(); ++i )
+	{
+        const midi_track & track = m_tracks[ i ];
+        snapshot_write_uint32( p_out, (uint32_t) track.m_events.size() );
+        snapshot_write_uint32( p_out, (uint32_t) track.m_payload.size() );
+        if ( track.m_events.size() ) snapshot_write( p_out, &track.m_events[0], track.m_events.size() * sizeof( midi_track::event_record ) );
+        if ( track.m_payload.size() ) snapshot_write( p_out, &track.m_payload[0], track.m_payload.size() );
+	}
+
+    snapshot_write_uint32( p_out, (uint32_t) m_port_numbers.size() );
+    if ( m_port_numbers.size() ) snapshot_write( p_out, &m_port_numbers[0], m_port_numbers.size() );
+
+    snapshot_write_uint32( p_out, (uint32_t) m_device_names.size() );
+    for ( std::size_t i = 0; i < m_device_names.size(); ++i )
+	{
+        snapshot_write_uint32( p_out, (uint32_t) m_device_names[ i ].size() );
+        for ( std::size_t j = 0; j < m_device_names[ i ].size(); ++j )
+            snapshot_write_string( p_out, m_device_names[ i ][ j ] );
+	}
+
+    snapshot_write_uint32( p_out, (uint32_t) m_extra_meta_data.get_count() );
+    for ( std::size_t i = 0; i < m_extra_meta_data.get_count(); ++i )
+	{
+        const midi_meta_data_item & item = m_extra_meta_data[ i ];
+        snapshot_write_timestamp( p_out, item.m_timestamp );
+        snapshot_write_string( p_out, item.m_name );
+        snapshot_write_string( p_out, item.m_value );
+	}
+
+    std::vector<uint8_t> bitmap;
+    m_extra_meta_data.get_bitmap( bitmap );
+    snapshot_write_uint32( p_out, (uint32_t) bitmap.size() );
+    if ( bitmap.size() ) snapshot_write( p_out, &bitmap[0], bitmap.size() );
+}
+
+bool midi_container::load_snapshot( midi_byte_span const& p_data )
+{
+    snapshot_reader reader( p_data );
+
+    const uint8_t * signature = reader.read( sizeof( snapshot_signature ) );
+    if ( !signature || memcmp( signature, snapshot_signature, sizeof( snapshot_signature ) ) ) return false;
+    if ( reader.read_uint32() != snapshot_version ) return false;
+    if ( reader.read_uint32() != snapshot_byte_order ) return false;
+    if ( reader.read_uint32() != sizeof( midi_track::event_record ) ) return false;
+
+    unsigned form = reader.read_uint32();
+    unsigned dtx = reader.read_uint32();
+    if ( form > 2 ) return false;
+
+    std::vector<uint64_t> channel_mask( reader.read_count( sizeof( uint64_t ) ) );
+    if ( channel_mask.size() ) reader.read( &channel_mask[0], channel_mask.size() * sizeof( uint64_t ) );
+
+    std::vector<unsigned long> timestamp_end, timestamp_loop_start, timestamp_loop_end;
+    reader.read_timestamps( timestamp_end );
+    reader.read_timestamps( timestamp_loop_start );
+    reader.read_timestamps( timestamp_loop_end );
+
+    std::vector<tempo_map> tempo_maps( reader.read_count( sizeof( uint32_t ) ) );
+    for ( std::size_t i = 0; i < tempo_maps.size() && reader.is_valid(); ++i )
+	{
+        tempo_map & map = tempo_maps[ i ];
+        map.set_division( dtx );
+        uint32_t count = reader.read_count( sizeof( uint64_t ) + sizeof( uint32_t ) );
+        for ( uint32_t j = 0; j < count; ++j )
+		{
+            unsigned long timestamp = reader.read_timestamp();
+            unsigned tempo = reader.read_uint32();
+            map.add_tempo( tempo, timestamp );
+		}
+	}
+
+    track_list tracks = track_list( midi_allocator<midi_track>( m_resource ) );
+    uint32_t track_count = reader.read_count( 2 * sizeof( uint32_t ) );
+    tracks.reserve( track_count );
+    for ( uint32_t i = 0; i < track_count && reader.is_valid(); ++i )
+	{
+        uint32_t event_count = reader.read_count( sizeof( midi_track::event_record ) );
+        uint32_t payload_size = reader.read_count( 1 );
+
+        tracks.push_back( midi_track( m_resource ) );
+        midi_track & track = tracks.back();
+
+        track.m_events.resize( event_count );
+        if ( event_count && !reader.read( &track.m_events[0], event_count * sizeof( midi_track::event_record ) ) ) return false;
+        track.m_payload.resize( payload_size );
+        if ( payload_size && !reader.read( &track.m_payload[0], payload_size ) ) return false;
+
+        /* Every record must describe an event its track can unpack */
+        for ( uint32_t j = 0; j < event_count; ++j )
+		{
+            const midi_track::event_record & record = track.m_events[ j ];
+            if ( record.m_type > midi_event::extended || record.m_reserved ) return false;
+            if ( record.m_type != midi_event::extended && record.m_channel >= 16 ) return false;
+            if ( record.m_data_count <= midi_track::max_inline_data_count ) continue;
+            if ( record.m_data_count != 0xFF ) return false;
+            uint32_t data_count;
+            if ( payload_size < sizeof( data_count ) || record.m_offset > payload_size - sizeof( data_count ) ) return false;
+            memcpy( &data_count, &track.m_payload[ record.m_offset ], sizeof( data_count ) );
+            if ( data_count > payload_size - sizeof( data_count ) - record.m_offset ) return false;
+		}
+	}
+
+    std::vector<uint8_t> port_numbers( reader.read_count( 1 ) );
+    if ( port_numbers.size() ) reader.read( &port_numbers[0], port_numbers.size() );
+
+    /* One list per channel, as set up by the constructor */
+    std::vector< std::vector< std::string > > device_names( reader.read_count( sizeof( uint32_t ) ) );
+    if ( device_names.size() != 16 ) return false;
+    for ( std::size_t i = 0; i < device_names.size() && reader.is_valid(); ++i )
+	{
+        device_names[ i ].resize( reader.read_count( sizeof( uint32_t ) ) );
+        for ( std::size_t j = 0; j < device_names[ i ].size(); ++j )
+            reader.read_string( device_names[ i ][ j ] );
+	}
+
+    midi_meta_data extra_meta_data;
+    uint32_t meta_data_count = reader.read_count( sizeof( uint64_t ) + 2 * sizeof( uint32_t ) );
+    for ( uint32_t i = 0; i < meta_data_count && reader.is_valid(); ++i )
+	{
+        midi_meta_data_item item;
+        item.m_timestamp = reader.read_timestamp();
+        reader.read_string( item.m_name );
+        reader.read_string( item.m_value );
+        extra_meta_data.add_item( item );
+	}
+
+    std::vector<uint8_t> bitmap( reader.read_count( 1 ) );
+    if ( bitmap.size() ) reader.read( &bitmap[0], bitmap.size() );
+    extra_meta_data.assign_bitmap( bitmap.begin(), bitmap.end() );
+
+    if ( !reader.is_valid() || !reader.at_end() ) return false;
+
+    /*
+     * Every track contributes an end timestamp. A type 2 file grows the other
+     * per-subsong tables only as far as its last track with tempo or note
+     * events, and its loop tables only in scan_for_loops. Tempo map lookups
+     * are bounds checked; pad the rest as an empty subsong would leave them.
+     */
+    std::size_t subsong_count = form == 2 ? tracks.size() : 1;
+    if ( tracks.size() && timestamp_end.size() < subsong_count ) return false;
+    if ( channel_mask.size() < subsong_count ) channel_mask.resize( subsong_count, 0 );
+    if ( timestamp_loop_start.size() < subsong_count ) timestamp_loop_start.resize( subsong_count, ~0UL );
+    if ( timestamp_loop_end.size() < subsong_count ) timestamp_loop_end.resize( subsong_count, ~0UL );
+
+    m_form = form;
+    m_dtx = dtx;
+    m_channel_mask.swap( channel_mask );
+    m_tempo_map.swap( tempo_maps );
+    m_tracks.swap( tracks );
+    m_port_numbers.swap( port_numbers );
+    m_device_names.swap( device_names );
+    m_extra_meta_data = extra_meta_data;
+    m_timestamp_end.swap( timestamp_end );
+    m_timestamp_loop_start.swap( timestamp_loop_start );
+    m_timestamp_loop_end.swap( timestamp_loop_end );
+
+    return true;
+}
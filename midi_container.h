@@ -2,22 +2,195 @@
 #define _MIDI_CONTAINER_H_
 
 #include <stdint.h>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #ifdef _MSC_VER
 #define strcasecmp _stricmp
 #define strncasecmp _strnicmp
 #define snprintf sprintf_s
+#if _MSC_VER < 1900
+#define noexcept throw()
+#endif
 #endif
 
-struct midi_event
+/*
+ * Read-only view of a caller's byte buffer. Converts implicitly from a
+ * vector, so existing callers keep working; the buffer must stay alive
+ * and unchanged for as long as the view is used.
+ */
+class midi_byte_span
 {
-	enum
-	{
-		max_static_data_count = 16
-	};
+    const uint8_t * m_data;
+    std::size_t m_size;
+
+public:
+    typedef const uint8_t * const_iterator;
+
+    midi_byte_span() : m_data( 0 ), m_size( 0 ) { }
+    midi_byte_span( const uint8_t * p_data, std::size_t p_size ) : m_data( p_data ), m_size( p_size ) { }
+    midi_byte_span( std::vector<uint8_t> const& p_data ) : m_data( p_data.size() ? &p_data[0] : 0 ), m_size( p_data.size() ) { }
+
+    const uint8_t * data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+    bool empty() const { return !m_size; }
+
+    const_iterator begin() const { return m_data; }
+    const_iterator end() const { return m_data + m_size; }
+
+    const uint8_t & operator [] ( std::size_t p_index ) const { return m_data[ p_index ]; }
+};
+
+/*
+ * Receives serialized output in order. Returning false aborts the
+ * serialization.
+ */
+typedef std::function<bool( const uint8_t * p_data, std::size_t p_size )> midi_write_callback;
+
+/*
+ * Runs independent pieces of a parse or serialization concurrently.
+ * run() calls p_task once for every index below p_count, in any order and
+ * on any thread, and returns only after every call has finished. Supply
+ * your own implementation to route the work through an existing pool.
+ */
+class midi_parallel_executor
+{
+public:
+    virtual ~midi_parallel_executor() { }
+
+    virtual void run( std::size_t p_count, const std::function<void( std::size_t )> & p_task ) = 0;
+};
+
+/*
+ * Spawns up to p_thread_count std::thread workers per run() call, the
+ * calling thread included. Zero means one per hardware thread.
+ */
+class midi_thread_executor : public midi_parallel_executor
+{
+    unsigned m_thread_count;
+
+public:
+    explicit midi_thread_executor( unsigned p_thread_count = 0 );
+
+    virtual void run( std::size_t p_count, const std::function<void( std::size_t )> & p_task );
+};
+
+/*
+ * Source of memory for track storage, modelled on std::pmr::memory_resource
+ * so it can be used without C++17. Tracks and containers built on one
+ * resource allocate from it for their whole lifetime.
+ */
+class midi_memory_resource
+{
+public:
+    virtual ~midi_memory_resource() { }
+
+    void * allocate( std::size_t p_bytes, std::size_t p_alignment ) { return do_allocate( p_bytes, p_alignment ); }
+    void deallocate( void * p_ptr, std::size_t p_bytes, std::size_t p_alignment ) { do_deallocate( p_ptr, p_bytes, p_alignment ); }
+    bool is_equal( const midi_memory_resource & p_other ) const { return this == &p_other || do_is_equal( p_other ); }
+
+    /* Plain operator new / operator delete; used whenever no resource is given */
+    static midi_memory_resource * get_default();
+
+protected:
+    virtual void * do_allocate( std::size_t p_bytes, std::size_t p_alignment ) = 0;
+    virtual void do_deallocate( void * p_ptr, std::size_t p_bytes, std::size_t p_alignment ) = 0;
+    virtual bool do_is_equal( const midi_memory_resource & p_other ) const = 0;
+};
+
+/*
+ * Hands out memory from a chain of growing blocks and never frees it
+ * individually; release() or destruction returns everything at once.
+ * Anything allocated from it must be destroyed before that happens.
+ * Allocation is serialized, so one resource can back a parallel parse.
+ */
+class midi_monotonic_buffer_resource : public midi_memory_resource
+{
+    struct block_header
+    {
+        block_header * m_next;
+        std::size_t m_size;
+    };
 
+    midi_memory_resource * m_upstream;
+    std::size_t m_next_block_size;
+    block_header * m_blocks;
+    uint8_t * m_current;
+    std::size_t m_remaining;
+    std::mutex m_lock;
+
+    midi_monotonic_buffer_resource( const midi_monotonic_buffer_resource & );
+    midi_monotonic_buffer_resource & operator = ( const midi_monotonic_buffer_resource & );
+
+protected:
+    virtual void * do_allocate( std::size_t p_bytes, std::size_t p_alignment );
+    virtual void do_deallocate( void * p_ptr, std::size_t p_bytes, std::size_t p_alignment );
+    virtual bool do_is_equal( const midi_memory_resource & p_other ) const;
+
+public:
+    explicit midi_monotonic_buffer_resource( std::size_t p_initial_size = 65536, midi_memory_resource * p_upstream = 0 );
+    virtual ~midi_monotonic_buffer_resource();
+
+    void release();
+};
+
+template <typename T>
+class midi_allocator
+{
+    midi_memory_resource * m_resource;
+
+public:
+    typedef T value_type;
+    typedef T * pointer;
+    typedef const T * const_pointer;
+    typedef T & reference;
+    typedef const T & const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template <typename U> struct rebind { typedef midi_allocator<U> other; };
+
+    midi_allocator() : m_resource( midi_memory_resource::get_default() ) { }
+    midi_allocator( midi_memory_resource * p_resource ) : m_resource( p_resource ? p_resource : midi_memory_resource::get_default() ) { }
+    template <typename U> midi_allocator( const midi_allocator<U> & p_in ) : m_resource( p_in.resource() ) { }
+
+    T * allocate( std::size_t p_count )
+    {
+        return static_cast<T *>( m_resource->allocate( p_count * sizeof( T ), std::alignment_of<T>::value ) );
+    }
+
+    void deallocate( T * p_ptr, std::size_t p_count )
+    {
+        m_resource->deallocate( p_ptr, p_count * sizeof( T ), std::alignment_of<T>::value );
+    }
+
+    midi_memory_resource * resource() const { return m_resource; }
+};
+
+template <typename T, typename U>
+inline bool operator == ( const midi_allocator<T> & p_a, const midi_allocator<U> & p_b )
+{
+    return p_a.resource()->is_equal( *p_b.resource() );
+}
+
+template <typename T, typename U>
+inline bool operator != ( const midi_allocator<T> & p_a, const midi_allocator<U> & p_b )
+{
+    return !( p_a == p_b );
+}
+
+/*
+ * Lightweight view of a single event. The payload is not owned; events
+ * returned by midi_track point into the track's own storage and stay
+ * valid until that track is next modified.
+ */
+struct midi_event
+{
 	enum event_type
 	{
 		note_off = 0,
@@ -35,11 +208,9 @@ struct midi_event
 	event_type m_type;
 	unsigned m_channel;
 	unsigned long m_data_count;
-    uint8_t m_data[max_static_data_count];
-    std::vector<uint8_t> m_ext_data;
+    const uint8_t * m_data;
 
-	midi_event() : m_timestamp(0), m_type(note_off), m_channel(0), m_data_count(0) { }
-	midi_event( const midi_event & p_in );
+	midi_event() : m_timestamp(0), m_type(note_off), m_channel(0), m_data_count(0), m_data(0) { }
     midi_event( unsigned long p_timestamp, event_type p_type, unsigned p_channel, const uint8_t * p_data, std::size_t p_data_count );
 
 	unsigned long get_data_count() const;
@@ -48,17 +219,80 @@ struct midi_event
 
 class midi_track
 {
-    std::vector<midi_event> m_events;
+    /*
+     * Packed event record. Payloads of up to max_inline_data_count bytes,
+     * which covers every channel event, are stored in the record itself.
+     * Longer payloads live in m_payload, prefixed with their 32-bit length.
+     * Timestamps are 32-bit; later ones are clamped to 0xFFFFFFFF ticks.
+     */
+    enum
+    {
+        max_inline_data_count = 4
+    };
+
+    struct event_record
+    {
+        uint32_t m_timestamp;
+        uint8_t m_type;
+        uint8_t m_channel;
+        uint8_t m_data_count;
+        uint8_t m_reserved;
+        union
+        {
+            uint8_t m_data[max_inline_data_count];
+            uint32_t m_offset;
+        };
+    };
+
+    std::vector<event_record, midi_allocator<event_record> > m_events;
+    std::vector<uint8_t, midi_allocator<uint8_t> > m_payload;
+
+    void pack_event( event_record & p_out, const midi_event & p_event );
+    midi_event unpack_event( const event_record & p_record ) const;
+    bool is_end_of_track( const event_record & p_record ) const;
+    static bool timestamp_less( const event_record & p_a, const event_record & p_b );
+
+    friend class midi_track_builder;
+    friend class midi_container;
+    void append_event( const midi_event & p_event );
+    void sort_events();
 
 public:
-	midi_track() { }
+	explicit midi_track( midi_memory_resource * p_resource = 0 );
 	midi_track(const midi_track & p_in);
+	midi_track(const midi_track & p_in, midi_memory_resource * p_resource);
+	midi_track(midi_track && p_in) noexcept;
+
+	midi_track & operator = (const midi_track & p_in);
+	midi_track & operator = (midi_track && p_in) noexcept;
 
 	void add_event( const midi_event & p_event );
     std::size_t get_count() const;
-    const midi_event & operator [] ( std::size_t p_index ) const;
+    midi_event operator [] ( std::size_t p_index ) const;
     
     void remove_event( unsigned long index );
+
+    midi_memory_resource * get_memory_resource() const;
+};
+
+/*
+ * Appends events in arrival order and sorts them once in finalize(), which
+ * yields the same ordering as repeated midi_track::add_event calls: stable
+ * by timestamp, with the end of track marker moved last and pushed out to
+ * the final timestamp.
+ */
+class midi_track_builder
+{
+    midi_track m_track;
+    bool m_sorted;
+
+public:
+    explicit midi_track_builder( midi_memory_resource * p_resource = 0 ) : m_track( p_resource ), m_sorted( true ) { }
+
+    void add_event( const midi_event & p_event );
+    std::size_t get_count() const;
+
+    midi_track & finalize();
 };
 
 struct tempo_entry
@@ -74,14 +308,62 @@ class tempo_map
 {
     std::vector<tempo_entry> m_entries;
 
+    /*
+     * Milliseconds elapsed between the first entry and each entry, rounded
+     * per segment exactly as the linear walk does. Only maintained once a
+     * division has been set; lookups for any other division walk the list.
+     */
+    unsigned m_division;
+    std::vector<unsigned long> m_entry_ms;
+
+    void update_index( std::size_t p_from );
+
 public:
+    tempo_map() : m_division( 0 ) { }
+
+    void set_division( unsigned p_dtx );
+
 	void add_tempo( unsigned p_tempo, unsigned long p_timestamp );
-    unsigned long timestamp_to_ms( unsigned long p_timestamp, unsigned p_dtx ) const;
+    unsigned long timestamp_to_ms( unsigned long p_timestamp, unsigned p_dtx, unsigned p_initial_tempo = 500000 ) const;
 
     std::size_t get_count() const;
     const tempo_entry & operator [] ( std::size_t p_index ) const;
 };
 
+/*
+ * Converts a non-decreasing sequence of timestamps by advancing through the
+ * tempo list instead of searching it on every call. Stepping backwards
+ * restarts from the beginning. Results match tempo_map::timestamp_to_ms.
+ *
+ * Given a sample rate, the cursor also converts to sample frames. Frames
+ * are rounded per tempo segment just as milliseconds are, using exact
+ * 64-bit integer arithmetic, so a rate of 1000 gives the millisecond
+ * values. Rates must be below 2^28.
+ */
+class tempo_map_cursor
+{
+    const tempo_map * m_map;
+    unsigned m_dtx;
+    unsigned m_initial_tempo;
+    unsigned m_sample_rate;
+
+    std::size_t m_index;
+    unsigned m_tempo;
+    unsigned long m_timestamp;
+    unsigned long m_timestamp_ms;
+    uint64_t m_timestamp_samples;
+
+    void advance( unsigned long p_timestamp );
+
+public:
+    tempo_map_cursor( const tempo_map * p_map, unsigned p_dtx, unsigned p_initial_tempo = 500000, unsigned p_sample_rate = 0 );
+
+    void reset();
+    unsigned long timestamp_to_ms( unsigned long p_timestamp );
+    /* Only valid on a cursor constructed with a sample rate */
+    unsigned long timestamp_to_samples( unsigned long p_timestamp );
+};
+
 struct system_exclusive_entry
 {
     std::size_t m_port;
@@ -97,9 +379,17 @@ class system_exclusive_table
     std::vector<uint8_t> m_data;
     std::vector<system_exclusive_entry> m_entries;
 
+    /*
+     * Entry indexes keyed by a hash of port, length and content, so
+     * add_entry only compares against likely duplicates.
+     */
+    std::unordered_multimap<uint32_t, unsigned> m_index;
+
+    static uint32_t hash_entry( const uint8_t * p_data, std::size_t p_size, std::size_t p_port );
+
 public:
     unsigned add_entry( const uint8_t * p_data, std::size_t p_size, std::size_t p_port );
-    void get_entry( unsigned p_index, const uint8_t * & p_data, std::size_t & p_size, std::size_t & p_port );
+    void get_entry( unsigned p_index, const uint8_t * & p_data, std::size_t & p_size, std::size_t & p_port ) const;
 };
 
 struct midi_stream_event
@@ -119,7 +409,13 @@ struct midi_meta_data_item
 
 	midi_meta_data_item() : m_timestamp(0) { }
 	midi_meta_data_item(const midi_meta_data_item & p_in);
+	midi_meta_data_item(midi_meta_data_item && p_in) noexcept;
+
+	midi_meta_data_item & operator = (const midi_meta_data_item & p_in);
+	midi_meta_data_item & operator = (midi_meta_data_item && p_in) noexcept;
 	midi_meta_data_item(unsigned long p_timestamp, const char * p_name, const char * p_value);
+	/* p_value need not be terminated; it ends at the first null or after p_value_length bytes */
+	midi_meta_data_item(unsigned long p_timestamp, const char * p_name, const char * p_value, std::size_t p_value_length);
 };
 
 class midi_meta_data
@@ -136,7 +432,7 @@ public:
 	
 	bool get_item( const char * p_name, midi_meta_data_item & p_out ) const;
 
-    bool get_bitmap( std::vector<uint8_t> & p_out );
+    bool get_bitmap( std::vector<uint8_t> & p_out ) const;
     
     void assign_bitmap( std::vector<uint8_t>::const_iterator const& begin, std::vector<uint8_t>::const_iterator const& end );
     
@@ -156,11 +452,14 @@ public:
 	};
 
 private:
+	midi_memory_resource * m_resource;
+
 	unsigned m_form;
 	unsigned m_dtx;
     std::vector<uint64_t> m_channel_mask;
     std::vector<tempo_map> m_tempo_map;
-    std::vector<midi_track> m_tracks;
+    typedef std::vector<midi_track, midi_allocator<midi_track> > track_list;
+    track_list m_tracks;
 
     std::vector<uint8_t> m_port_numbers;
 
@@ -173,7 +472,14 @@ private:
     std::vector<unsigned long> m_timestamp_loop_start;
     std::vector<unsigned long> m_timestamp_loop_end;
 
+    unsigned get_initial_tempo( unsigned long p_subsong ) const;
     unsigned long timestamp_to_ms( unsigned long p_timestamp, unsigned long p_subsong ) const;
+    unsigned long timestamp_to_samples( unsigned long p_timestamp, unsigned long p_subsong, unsigned p_sample_rate ) const;
+    tempo_map_cursor get_tempo_cursor( unsigned long p_subsong, unsigned p_sample_rate = 0 ) const;
+
+    void scan_added_track();
+
+    friend class midi_stream_cursor;
 
     /*
      * Normalize port numbers properly
@@ -205,11 +511,18 @@ private:
     }
 
 public:
-    midi_container() { m_device_names.resize( 16 ); }
+    /*
+     * Track storage is allocated from p_resource, or the default heap if
+     * none is given. The resource must outlive the container.
+     */
+    explicit midi_container( midi_memory_resource * p_resource = 0 );
+
+    midi_memory_resource * get_memory_resource() const;
 
 	void initialize( unsigned p_form, unsigned p_dtx );
 
 	void add_track( const midi_track & p_track );
+	void add_track( midi_track && p_track );
 
     void add_track_event( std::size_t p_track_index, const midi_event & p_event );
 
@@ -228,8 +541,44 @@ public:
     void apply_hackfix( unsigned hack );
 
     void serialize_as_stream( unsigned long subsong, std::vector<midi_stream_event> & p_stream, system_exclusive_table & p_system_exclusive, unsigned long & loop_start, unsigned long & loop_end, unsigned clean_flags ) const;
+    /*
+     * As above, with event timestamps in sample frames at p_sample_rate
+     * instead of milliseconds. Loop points are still event indexes; the
+     * get_timestamp_*_samples functions give their times in the same frames.
+     */
+    void serialize_as_stream( unsigned long subsong, std::vector<midi_stream_event> & p_stream, system_exclusive_table & p_system_exclusive, unsigned long & loop_start, unsigned long & loop_end, unsigned clean_flags, unsigned p_sample_rate ) const;
 
-    void serialize_as_standard_midi_file( std::vector<uint8_t> & p_midi_file ) const;
+    /*
+     * Appends the file to p_midi_file, which is grown once to its final
+     * size. With an executor, tracks are measured and encoded concurrently,
+     * each straight into its own place in the output; the bytes are the
+     * same either way.
+     */
+    void serialize_as_standard_midi_file( std::vector<uint8_t> & p_midi_file, midi_parallel_executor * p_executor = 0 ) const;
+    /*
+     * Streams the same bytes through p_write in order, track by track, using
+     * a fixed-size buffer. Track lengths are computed before each track is
+     * written, so nothing needs to be revisited. Returns false if p_write
+     * did, without writing anything further.
+     */
+    bool serialize_as_standard_midi_file( const midi_write_callback & p_write ) const;
+    /* Writes to a file descriptor, retrying short writes */
+    bool serialize_as_standard_midi_file( int p_fd ) const;
+
+    /*
+     * Appends a versioned binary image of everything the container holds:
+     * tracks, tempo maps, channel masks, port numbers, device names, extra
+     * meta data and loop points. Track storage is written as is, so loading
+     * is a handful of bulk copies instead of a conversion. Images use the
+     * writing machine's byte order and are rejected by machines with another.
+     */
+    void serialize_as_snapshot( std::vector<uint8_t> & p_out ) const;
+    /*
+     * Replaces the container's contents with a snapshot. Returns false,
+     * leaving the container untouched, if the image is truncated, corrupt
+     * or from another version. Nothing refers back to p_data afterwards.
+     */
+    bool load_snapshot( midi_byte_span const& p_data );
 
     void promote_to_type1();
 
@@ -245,6 +594,11 @@ public:
     unsigned long get_timestamp_loop_start(unsigned long subsong, bool ms = false) const;
     unsigned long get_timestamp_loop_end(unsigned long subsong, bool ms = false) const;
 
+    /* In sample frames at p_sample_rate, matching serialize_as_stream's frame timestamps */
+    unsigned long get_timestamp_end_samples(unsigned long subsong, unsigned p_sample_rate) const;
+    unsigned long get_timestamp_loop_start_samples(unsigned long subsong, unsigned p_sample_rate) const;
+    unsigned long get_timestamp_loop_end_samples(unsigned long subsong, unsigned p_sample_rate) const;
+
 	void get_meta_data( unsigned long subsong, midi_meta_data & p_out );
 
 	void scan_for_loops( bool p_xmi_loops, bool p_marker_loops, bool p_rpgmaker_loops );
@@ -252,4 +606,60 @@ public:
     static void encode_delta( std::vector<uint8_t> & p_out, unsigned long delta );
 };
 
+/*
+ * Produces the same event stream as midi_container::serialize_as_stream in
+ * blocks, so a player only holds as much of it as it asks for. The container
+ * and System Exclusive table must outlive the cursor. Loop points are event
+ * indexes counted from the first event this cursor produced, and read ~0UL
+ * until the cursor has reached them.
+ */
+class midi_stream_cursor
+{
+    typedef std::pair<unsigned long, std::size_t> merge_entry;
+
+    const midi_container & m_container;
+    system_exclusive_table & m_system_exclusive;
+    tempo_map_cursor m_tempo_cursor;
+    bool m_sample_frames;
+
+    bool m_clean_instruments;
+    bool m_clean_banks;
+
+    std::vector<std::size_t> m_track_positions;
+    std::vector<uint8_t> m_port_numbers;
+    std::vector<std::string> m_device_names;
+    std::vector<merge_entry> m_merge_heap;
+
+    unsigned long m_tick_loop_start;
+    unsigned long m_tick_loop_end;
+    unsigned long m_loop_start;
+    unsigned long m_loop_end;
+    unsigned long m_position;
+
+    unsigned long get_time( unsigned long p_timestamp );
+    void resolve_device_name( std::size_t p_track, unsigned p_channel );
+    void step( std::vector<midi_stream_event> & p_out );
+
+    midi_stream_cursor( const midi_stream_cursor & );
+    midi_stream_cursor & operator = ( const midi_stream_cursor & );
+
+public:
+    /* With a sample rate, timestamps are in sample frames instead of milliseconds */
+    midi_stream_cursor( const midi_container & p_container, unsigned long p_subsong, system_exclusive_table & p_system_exclusive, unsigned p_clean_flags, unsigned p_sample_rate = 0 );
+
+    /*
+     * Both append to p_out and return the number of events appended:
+     * at most p_count events, or every event before p_timestamp, which is
+     * in the same units as the events.
+     */
+    std::size_t read( std::vector<midi_stream_event> & p_out, std::size_t p_count );
+    std::size_t read_until( std::vector<midi_stream_event> & p_out, unsigned long p_timestamp );
+
+    bool is_finished() const;
+    unsigned long get_position() const;
+
+    unsigned long get_loop_start() const;
+    unsigned long get_loop_end() const;
+};
+
 #endif
@@ -9,6 +9,157 @@ char ( &_ArraySizeHelper( T (&array)[N] ))[N];
 #define _countof( array ) (sizeof( _ArraySizeHelper( array ) ))
 #endif
 
+/*
+ * Read-only memory mapping of a whole file, released on close() or
+ * destruction. Empty files open successfully with no data.
+ */
+class midi_mapped_file
+{
+#ifdef _WIN32
+    void * m_file;
+    void * m_mapping;
+#endif
+    const uint8_t * m_data;
+    std::size_t m_size;
+    bool m_open;
+
+    midi_mapped_file( const midi_mapped_file & );
+    midi_mapped_file & operator = ( const midi_mapped_file & );
+
+public:
+    midi_mapped_file();
+    ~midi_mapped_file();
+
+    /* p_path is UTF-8 */
+    bool open( const char * p_path );
+    void close();
+
+    bool is_open() const { return m_open; }
+    const uint8_t * data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+    midi_byte_span get_span() const { return midi_byte_span( m_data, m_size ); }
+};
+
+struct midi_processor_options
+{
+    /*
+     * When set, formats whose tracks can be located up front are decoded
+     * one track per task. Tracks are still added to the container in file
+     * order, so the result is identical to a serial parse.
+     */
+    midi_parallel_executor * m_executor;
+
+    /*
+     * Adlib effects emulated when converting LDS files. Vibrato and
+     * arpeggio are rendered through the pitch wheel; without it, vibrato
+     * does nothing and arpeggio only shifts each note by its first step.
+     * Every combination is compiled separately, so disabled effects cost
+     * nothing per tick. The defaults match earlier releases.
+     */
+    bool m_lds_pitch_wheel;
+    bool m_lds_vibrato;
+    bool m_lds_tremolo;
+    bool m_lds_arpeggio;
+
+    midi_processor_options() : m_executor( 0 ), m_lds_pitch_wheel( true ), m_lds_vibrato( false ), m_lds_tremolo( false ), m_lds_arpeggio( false ) { }
+};
+
+/*
+ * Receives the output of standard_midi_stream_parser. Returning false from
+ * any callback stops the parse.
+ */
+class midi_parser_sink
+{
+public:
+    virtual ~midi_parser_sink() { }
+
+    virtual bool begin_file( unsigned p_form, unsigned p_track_count, unsigned p_dtx ) = 0;
+    virtual bool begin_track( std::size_t p_index ) = 0;
+    /* p_event's data is only valid for the duration of the call */
+    virtual bool add_event( const midi_event & p_event ) = 0;
+    virtual bool end_track() = 0;
+};
+
+/*
+ * Collects parsed tracks into a container, giving the same result as
+ * midi_processor::process_file on the same bytes. Only the track being
+ * decoded is held outside the container.
+ */
+class midi_container_parser_sink : public midi_parser_sink
+{
+    midi_container & m_out;
+    midi_track_builder m_track;
+
+public:
+    explicit midi_container_parser_sink( midi_container & p_out ) : m_out( p_out ) { }
+
+    virtual bool begin_file( unsigned p_form, unsigned p_track_count, unsigned p_dtx );
+    virtual bool begin_track( std::size_t p_index );
+    virtual bool add_event( const midi_event & p_event );
+    virtual bool end_track();
+};
+
+/*
+ * Resumable Standard MIDI File parser. Input may be fed in pieces of any
+ * size, split anywhere; running status, partially read numbers and
+ * partially read System Exclusive or meta messages carry over between
+ * calls. Memory use is bounded by the largest single message.
+ */
+class standard_midi_stream_parser
+{
+    enum parse_state
+    {
+        state_file_header,
+        state_track_header,
+        state_delta,
+        state_status,
+        state_channel_data,
+        state_meta_type,
+        state_length,
+        state_payload,
+        state_skip_track,
+        state_done,
+        state_failed
+    };
+
+    midi_parser_sink & m_sink;
+    parse_state m_state;
+
+    std::vector<uint8_t> m_buffer;
+    std::size_t m_needed;
+
+    unsigned m_track_count;
+    unsigned m_track_index;
+    uint32_t m_track_remaining;
+
+    uint32_t m_number;
+    unsigned m_timestamp;
+    uint8_t m_last_event_code;
+    uint8_t m_event_code;
+    uint8_t m_data[2];
+    unsigned m_data_count;
+    unsigned m_data_needed;
+
+    bool fail();
+    bool next_track();
+    bool end_delta();
+    bool end_length();
+    bool end_channel_message();
+    bool end_message();
+    bool end_track_data();
+    bool process_status( uint8_t p_byte );
+
+public:
+    explicit standard_midi_stream_parser( midi_parser_sink & p_sink );
+
+    /* Returns false once the input has been found invalid or the sink stopped the parse */
+    bool feed( const uint8_t * p_data, std::size_t p_size );
+    /* True if every track announced in the header was read completely */
+    bool finish();
+};
+
+struct midi_file_info;
+
 class midi_processor
 {
     static const uint8_t end_of_track[2];
@@ -24,38 +175,128 @@ class midi_processor
 
     static const uint8_t lds_default_tempo[5];
 
-    static int decode_delta( std::vector<uint8_t>::const_iterator & it, std::vector<uint8_t>::const_iterator end );
-    static unsigned decode_hmp_delta( std::vector<uint8_t>::const_iterator & it, std::vector<uint8_t>::const_iterator end );
-    static unsigned decode_xmi_delta( std::vector<uint8_t>::const_iterator & it, std::vector<uint8_t>::const_iterator end );
-
-    static bool is_standard_midi( std::vector<uint8_t> const& p_file );
-    static bool is_riff_midi( std::vector<uint8_t> const& p_file );
-    static bool is_hmp( std::vector<uint8_t> const& p_file );
-    static bool is_hmi( std::vector<uint8_t> const& p_file );
-    static bool is_xmi( std::vector<uint8_t> const& p_file );
-    static bool is_mus( std::vector<uint8_t> const& p_file );
-    static bool is_mids( std::vector<uint8_t> const& p_file );
-    static bool is_lds( std::vector<uint8_t> const& p_file, const char * p_extension );
-    static bool is_gmf( std::vector<uint8_t> const& p_file );
-    static bool is_syx( std::vector<uint8_t> const& p_file );
-
-    static bool process_standard_midi_track( std::vector<uint8_t>::const_iterator & it, std::vector<uint8_t>::const_iterator end, midi_container & p_out, bool needs_end_marker );
-
-    static bool process_standard_midi( std::vector<uint8_t> const& p_file, midi_container & p_out );
-    static bool process_riff_midi( std::vector<uint8_t> const& p_file, midi_container & p_out );
-    static bool process_hmp( std::vector<uint8_t> const& p_file, midi_container & p_out );
-    static bool process_hmi( std::vector<uint8_t> const& p_file, midi_container & p_out );
-    static bool process_xmi( std::vector<uint8_t> const& p_file, midi_container & p_out );
-    static bool process_mus( std::vector<uint8_t> const& p_file, midi_container & p_out );
-    static bool process_mids( std::vector<uint8_t> const& p_file, midi_container & p_out );
-    static bool process_lds( std::vector<uint8_t> const& p_file, midi_container & p_out );
-    static bool process_gmf( std::vector<uint8_t> const& p_file, midi_container & p_out );
-    static bool process_syx( std::vector<uint8_t> const& p_file, midi_container & p_out );
+    /*
+     * Returns the first byte in [it, end) whose high bit equals p_high_bit,
+     * or end. Compares 16 bytes at a time where SSE2 is available.
+     */
+    static midi_byte_span::const_iterator find_delta_stop( midi_byte_span::const_iterator it, midi_byte_span::const_iterator end, bool p_high_bit );
+
+    static int decode_delta( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator end );
+    static unsigned decode_hmp_delta( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator end );
+    static unsigned decode_xmi_delta( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator end );
+
+    static bool is_standard_midi( midi_byte_span const& p_file );
+    static bool is_riff_midi( midi_byte_span const& p_file );
+    static bool is_hmp( midi_byte_span const& p_file );
+    static bool is_hmi( midi_byte_span const& p_file );
+    static bool is_xmi( midi_byte_span const& p_file );
+    static bool is_mus( midi_byte_span const& p_file );
+    static bool is_mids( midi_byte_span const& p_file );
+    static bool is_lds( midi_byte_span const& p_file, const char * p_extension );
+    static bool is_gmf( midi_byte_span const& p_file );
+    static bool is_syx( midi_byte_span const& p_file );
+
+    static bool decode_standard_midi_track( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator end, midi_track_builder & p_track, bool needs_end_marker );
+    static bool process_standard_midi_track( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator end, midi_container & p_out, bool needs_end_marker );
+
+    static bool process_standard_midi( midi_byte_span const& p_file, midi_container & p_out, midi_processor_options const& p_options );
+    static bool process_riff_midi( midi_byte_span const& p_file, midi_container & p_out, midi_processor_options const& p_options );
+    static bool decode_hmp_track( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator track_end, midi_track_builder & track );
+    static bool decode_hmi_track( midi_byte_span const& p_track_data, midi_track_builder & track, std::vector<midi_event> & loop_events );
+
+    static bool process_hmp( midi_byte_span const& p_file, midi_container & p_out, midi_processor_options const& p_options );
+    static bool process_hmi( midi_byte_span const& p_file, midi_container & p_out, midi_processor_options const& p_options );
+    static bool process_xmi( midi_byte_span const& p_file, midi_container & p_out );
+    static bool process_mus( midi_byte_span const& p_file, midi_container & p_out );
+    static bool process_mids( midi_byte_span const& p_file, midi_container & p_out );
+    template <bool enable_wheel, bool enable_vib, bool enable_trem, bool enable_arp>
+    static bool process_lds_emulated( midi_byte_span const& p_file, midi_container & p_out );
+    static bool process_lds( midi_byte_span const& p_file, midi_container & p_out, midi_processor_options const& p_options );
+    static bool process_gmf( midi_byte_span const& p_file, midi_container & p_out );
+    static bool process_syx( midi_byte_span const& p_file, midi_container & p_out );
 
 public:
-    static bool process_file( std::vector<uint8_t> const& p_file, const char * p_extension, midi_container & p_out );
+    enum file_format
+    {
+        format_unknown = 0,
+        format_standard_midi,
+        format_riff_midi,
+        format_hmp,
+        format_hmi,
+        format_xmi,
+        format_mus,
+        format_mids,
+        format_lds,
+        format_gmf,
+        format_syx
+    };
+
+    /*
+     * Classifies the input from its leading bytes without parsing it. The
+     * extension is only consulted for LDS, which has no signature. Formats
+     * are tried in the same precedence as process_file.
+     */
+    static file_format identify( midi_byte_span const& p_file, const char * p_extension );
+
+    /*
+     * Fills p_info with what a playlist needs (subsongs, lengths, loop points,
+     * channel counts) as if the file had been loaded with process_file and
+     * scanned with scan_for_loops using the given flags. Standard MIDI Files
+     * are read keeping only the events those values depend on; other formats
+     * are fully parsed.
+     */
+    static bool probe_file( midi_byte_span const& p_file, const char * p_extension, midi_file_info & p_info, bool p_xmi_loops = true, bool p_marker_loops = true, bool p_rpgmaker_loops = true );
+
+    /*
+     * The input is only read during the call; nothing in p_out refers back to it.
+     */
+    static bool process_file( midi_byte_span const& p_file, const char * p_extension, midi_container & p_out );
+    static bool process_file( const uint8_t * p_data, std::size_t p_size, const char * p_extension, midi_container & p_out );
+    /* Optionally reports the detected format through p_format, even when parsing fails */
+    static bool process_file( midi_byte_span const& p_file, const char * p_extension, midi_container & p_out, midi_processor_options const& p_options, file_format * p_format = 0 );
+
+    static bool process_syx_file( midi_byte_span const& p_file, midi_container & p_out );
+    static bool process_syx_file( const uint8_t * p_data, std::size_t p_size, midi_container & p_out );
+
+    /*
+     * Maps the file and parses it in place, taking the extension from the
+     * path. The first form unmaps before returning; the second leaves the
+     * mapping open in p_mapping so the caller can keep using the raw bytes.
+     */
+    static bool process_path( const char * p_path, midi_container & p_out );
+    static bool process_path( const char * p_path, midi_container & p_out, midi_mapped_file & p_mapping );
+    static bool process_path( const char * p_path, midi_container & p_out, midi_mapped_file & p_mapping, midi_processor_options const& p_options );
+};
+
+struct midi_subsong_info
+{
+    /* Subsong number as accepted by the midi_container accessors */
+    unsigned long m_subsong;
+
+    unsigned long m_timestamp_end;
+    unsigned long m_timestamp_end_ms;
+
+    /* ~0UL where there is no loop point */
+    unsigned long m_timestamp_loop_start;
+    unsigned long m_timestamp_loop_start_ms;
+    unsigned long m_timestamp_loop_end;
+    unsigned long m_timestamp_loop_end_ms;
+
+    unsigned m_channel_count;
+
+    midi_subsong_info() : m_subsong(0), m_timestamp_end(0), m_timestamp_end_ms(0),
+        m_timestamp_loop_start(~0UL), m_timestamp_loop_start_ms(~0UL), m_timestamp_loop_end(~0UL), m_timestamp_loop_end_ms(~0UL),
+        m_channel_count(0) { }
+};
+
+struct midi_file_info
+{
+    midi_processor::file_format m_format;
+    unsigned m_form;
+    unsigned m_track_count;
+    std::vector<midi_subsong_info> m_subsongs;
 
-    static bool process_syx_file( std::vector<uint8_t> const& p_file, midi_container & p_out );
+    midi_file_info() : m_format(midi_processor::format_unknown), m_form(0), m_track_count(0) { }
 };
 
 #endif
@@ -1,13 +1,13 @@
 #include "midi_processor.h"
 
-bool midi_processor::is_gmf( std::vector<uint8_t> const& p_file )
+bool midi_processor::is_gmf( midi_byte_span const& p_file )
 {
     if ( p_file.size() < 32 ) return false;
     if ( p_file[ 0 ] != 'G' || p_file[ 1 ] != 'M' || p_file[ 2 ] != 'F' || p_file[ 3 ] != 1 ) return false;
 	return true;
 }
 
-bool midi_processor::process_gmf( std::vector<uint8_t> const& p_file, midi_container & p_out )
+bool midi_processor::process_gmf( midi_byte_span const& p_file, midi_container & p_out )
 {
     uint8_t buffer[10];
 
@@ -16,7 +16,7 @@ bool midi_processor::process_gmf( std::vector<uint8_t> const& p_file, midi_conta
     uint16_t tempo = ( p_file[ 4 ] << 8 ) | p_file[ 5 ];
     uint32_t tempo_scaled = tempo * 100000;
 
-	midi_track track;
+	midi_track_builder track( p_out.get_memory_resource() );
 
 	buffer[0] = 0xFF;
 	buffer[1] = 0x51;
@@ -44,9 +44,9 @@ bool midi_processor::process_gmf( std::vector<uint8_t> const& p_file, midi_conta
 
 	track.add_event( midi_event( 0, midi_event::extended, 0, buffer, 2 ) );
 
-	p_out.add_track( track );
+	p_out.add_track( std::move( track.finalize() ) );
 
-    std::vector<uint8_t>::const_iterator it = p_file.begin() + 7;
+    midi_byte_span::const_iterator it = p_file.begin() + 7;
 
     return process_standard_midi_track( it, p_file.end(), p_out, false );
 }
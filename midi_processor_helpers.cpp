@@ -1,65 +1,284 @@
 #include "midi_processor.h"
 
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#define MIDI_PROCESSOR_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 const uint8_t midi_processor::end_of_track[2] = {0xFF, 0x2F};
 const uint8_t midi_processor::loop_start[11] = {0xFF, 0x06, 'l', 'o', 'o', 'p', 'S', 't', 'a', 'r', 't'};
 const uint8_t midi_processor::loop_end[9] =    {0xFF, 0x06, 'l', 'o', 'o', 'p', 'E', 'n', 'd'};
 
-int midi_processor::decode_delta( std::vector<uint8_t>::const_iterator & it, std::vector<uint8_t>::const_iterator end )
+#ifdef MIDI_PROCESSOR_SSE2
+static inline unsigned lowest_set_bit( unsigned p_mask )
 {
-	int delta = 0;
-	unsigned char byte;
-	do
-	{
-		if ( it == end ) return 0;
-        byte = *it++;
-		delta = ( delta << 7 ) + ( byte & 0x7F );
-	}
-	while ( byte & 0x80 );
-	return delta;
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward( &index, p_mask );
+    return index;
+#else
+    return __builtin_ctz( p_mask );
+#endif
 }
+#endif
 
-bool midi_processor::process_file( std::vector<uint8_t> const& p_file, const char * p_extension, midi_container & p_out )
+midi_byte_span::const_iterator midi_processor::find_delta_stop( midi_byte_span::const_iterator it, midi_byte_span::const_iterator end, bool p_high_bit )
 {
-    if ( is_standard_midi( p_file ) )
-	{
-        return process_standard_midi( p_file, p_out );
-	}
-    else if ( is_riff_midi( p_file ) )
+#ifdef MIDI_PROCESSOR_SSE2
+    unsigned flip = p_high_bit ? 0 : 0xFFFF;
+    while ( end - it >= 16 )
+    {
+        unsigned mask = ( (unsigned) _mm_movemask_epi8( _mm_loadu_si128( (const __m128i *) it ) ) ^ flip ) & 0xFFFF;
+        if ( mask ) return it + lowest_set_bit( mask );
+        it += 16;
+    }
+#endif
+    for ( ; it != end; ++it )
+    {
+        if ( ( ( *it & 0x80 ) != 0 ) == p_high_bit ) break;
+    }
+    return it;
+}
+
+int midi_processor::decode_delta( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator end )
+{
+    if ( it == end ) return 0;
+    if ( !( *it & 0x80 ) ) return *it++;
+
+    /* A number cut off by end reads as zero, with everything up to end consumed */
+    midi_byte_span::const_iterator stop = find_delta_stop( it, end, false );
+    if ( stop == end )
+    {
+        it = end;
+        return 0;
+    }
+
+	unsigned delta = 0;
+    while ( it != stop ) delta = ( delta << 7 ) + ( *it++ & 0x7F );
+    delta = ( delta << 7 ) + *it++;
+	return (int) delta;
+}
+
+bool midi_processor::process_file( midi_byte_span const& p_file, const char * p_extension, midi_container & p_out )
+{
+    return process_file( p_file, p_extension, p_out, midi_processor_options() );
+}
+
+midi_processor::file_format midi_processor::identify( midi_byte_span const& p_file, const char * p_extension )
+{
+    if ( p_file.empty() ) return format_unknown;
+
+    /* Every signature starts with a different first byte, so one probe at most needs to run per family */
+    switch ( p_file[ 0 ] )
 	{
-        return process_riff_midi( p_file, p_out );
+    case 'M':
+        if ( is_standard_midi( p_file ) ) return format_standard_midi;
+        if ( is_mus( p_file ) ) return format_mus;
+        break;
+
+    case 'R':
+        if ( p_file.size() < 12 ) break;
+        if ( p_file[ 8 ] == 'R' && is_riff_midi( p_file ) ) return format_riff_midi;
+        if ( p_file[ 8 ] == 'M' && is_mids( p_file ) ) return format_mids;
+        break;
+
+    case 'H':
+        if ( p_file.size() < 4 ) break;
+        if ( p_file[ 3 ] == 'M' && is_hmp( p_file ) ) return format_hmp;
+        if ( p_file[ 3 ] == '-' && is_hmi( p_file ) ) return format_hmi;
+        break;
+
+    case 'F':
+        if ( is_xmi( p_file ) ) return format_xmi;
+        break;
+
+    case 'G':
+        if ( is_gmf( p_file ) ) return format_gmf;
+        break;
+
+    case 0xF0:
+        if ( is_syx( p_file ) ) return format_syx;
+        break;
+
+    default:
+        if ( p_extension && is_lds( p_file, p_extension ) ) return format_lds;
+        break;
 	}
-    else if ( is_hmp( p_file ) )
-	{
-        return process_hmp( p_file, p_out );
+
+    return format_unknown;
+}
+
+/*
+ * Passes on only the events that feed tempo, port, channel mask, loop and
+ * length bookkeeping in midi_container. Of the notes, only the first per
+ * channel since the last port change is kept; the rest could only set
+ * channel mask bits that are already set.
+ */
+class midi_probe_parser_sink : public midi_container_parser_sink
+{
+    bool m_channel_seen[16];
+
+    void reset_channels()
+    {
+        for ( unsigned i = 0; i < 16; ++i ) m_channel_seen[ i ] = false;
     }
-    else if ( is_hmi( p_file ) )
-	{
-        return process_hmi( p_file, p_out );
+
+public:
+    explicit midi_probe_parser_sink( midi_container & p_out ) : midi_container_parser_sink( p_out )
+    {
+        reset_channels();
     }
-    else if ( is_xmi( p_file ) )
-	{
-        return process_xmi( p_file, p_out );
+
+    virtual bool begin_track( std::size_t p_index )
+    {
+        reset_channels();
+        return midi_container_parser_sink::begin_track( p_index );
     }
-    else if ( is_mus( p_file ) )
-	{
-        return process_mus( p_file, p_out );
+
+    virtual bool add_event( const midi_event & p_event )
+    {
+        switch ( p_event.m_type )
+        {
+        case midi_event::note_on:
+        case midi_event::note_off:
+            if ( m_channel_seen[ p_event.m_channel ] ) return true;
+            m_channel_seen[ p_event.m_channel ] = true;
+            break;
+
+        case midi_event::control_change:
+            /* EMIDI and RPG Maker loop controllers, XMI loop controllers */
+            if ( p_event.m_data[ 0 ] != 110 && p_event.m_data[ 0 ] != 111 &&
+                 p_event.m_data[ 0 ] != 0x74 && p_event.m_data[ 0 ] != 0x75 ) return true;
+            break;
+
+        case midi_event::extended:
+            if ( p_event.m_data_count < 2 || p_event.m_data[ 0 ] != 0xFF ) return true;
+            switch ( p_event.m_data[ 1 ] )
+            {
+            case 0x04:
+            case 0x09:
+            case 0x21:
+                reset_channels();
+                break;
+
+            case 0x06:
+            case 0x2F:
+            case 0x51:
+                break;
+
+            default:
+                return true;
+            }
+            break;
+
+        default:
+            return true;
+        }
+        return midi_container_parser_sink::add_event( p_event );
     }
-    else if ( is_mids( p_file ) )
-	{
-        return process_mids( p_file, p_out );
+};
+
+bool midi_processor::probe_file( midi_byte_span const& p_file, const char * p_extension, midi_file_info & p_info, bool p_xmi_loops, bool p_marker_loops, bool p_rpgmaker_loops )
+{
+    midi_container container;
+
+    p_info = midi_file_info();
+    p_info.m_format = identify( p_file, p_extension );
+
+    if ( p_info.m_format == format_standard_midi )
+    {
+        midi_probe_parser_sink sink( container );
+        standard_midi_stream_parser parser( sink );
+        if ( !parser.feed( p_file.data(), p_file.size() ) || !parser.finish() ) return false;
     }
-    else if ( is_lds( p_file, p_extension ) )
-	{
-        return process_lds( p_file, p_out );
+    else if ( !process_file( p_file, p_extension, container, midi_processor_options() ) ) return false;
+
+    container.scan_for_loops( p_xmi_loops, p_marker_loops, p_rpgmaker_loops );
+
+    p_info.m_form = container.get_format();
+    p_info.m_track_count = container.get_track_count();
+
+    unsigned long subsong_count = container.get_subsong_count();
+    p_info.m_subsongs.resize( subsong_count );
+
+    for ( unsigned long i = 0; i < subsong_count; ++i )
+    {
+        midi_subsong_info & info = p_info.m_subsongs[ i ];
+        unsigned long subsong = container.get_subsong( i );
+        info.m_subsong = subsong;
+        info.m_timestamp_end = container.get_timestamp_end( subsong );
+        info.m_timestamp_end_ms = container.get_timestamp_end( subsong, true );
+        info.m_timestamp_loop_start = container.get_timestamp_loop_start( subsong );
+        info.m_timestamp_loop_start_ms = container.get_timestamp_loop_start( subsong, true );
+        info.m_timestamp_loop_end = container.get_timestamp_loop_end( subsong );
+        info.m_timestamp_loop_end_ms = container.get_timestamp_loop_end( subsong, true );
+        info.m_channel_count = container.get_channel_count( subsong );
     }
-    else if ( is_gmf( p_file ) )
+
+    return true;
+}
+
+bool midi_processor::process_file( midi_byte_span const& p_file, const char * p_extension, midi_container & p_out, midi_processor_options const& p_options, file_format * p_format /* = 0 */ )
+{
+    file_format format = identify( p_file, p_extension );
+    if ( p_format ) *p_format = format;
+
+    switch ( format )
 	{
+    case format_standard_midi:
+        return process_standard_midi( p_file, p_out, p_options );
+
+    case format_riff_midi:
+        return process_riff_midi( p_file, p_out, p_options );
+
+    case format_hmp:
+        return process_hmp( p_file, p_out, p_options );
+
+    case format_hmi:
+        return process_hmi( p_file, p_out, p_options );
+
+    case format_xmi:
+        return process_xmi( p_file, p_out );
+
+    case format_mus:
+        return process_mus( p_file, p_out );
+
+    case format_mids:
+        return process_mids( p_file, p_out );
+
+    case format_lds:
+        return process_lds( p_file, p_out, p_options );
+
+    case format_gmf:
         return process_gmf( p_file, p_out );
-    }
-    else return false;
+
+    default:
+        /* System Exclusive dumps are only loaded through process_syx_file */
+        return false;
+	}
 }
 
-bool midi_processor::process_syx_file( std::vector<uint8_t> const& p_file, midi_container & p_out )
+bool midi_processor::process_file( const uint8_t * p_data, std::size_t p_size, const char * p_extension, midi_container & p_out )
+{
+    return process_file( midi_byte_span( p_data, p_size ), p_extension, p_out );
+}
+
+bool midi_processor::process_syx_file( midi_byte_span const& p_file, midi_container & p_out )
 {
     if ( is_syx( p_file ) )
     {
@@ -67,3 +286,142 @@ bool midi_processor::process_syx_file( std::vector<uint8_t> const& p_file, midi_
     }
     else return false;
 }
+
+bool midi_processor::process_syx_file( const uint8_t * p_data, std::size_t p_size, midi_container & p_out )
+{
+    return process_syx_file( midi_byte_span( p_data, p_size ), p_out );
+}
+
+midi_mapped_file::midi_mapped_file()
+{
+#ifdef _WIN32
+    m_file = INVALID_HANDLE_VALUE;
+    m_mapping = 0;
+#endif
+    m_data = 0;
+    m_size = 0;
+    m_open = false;
+}
+
+midi_mapped_file::~midi_mapped_file()
+{
+    close();
+}
+
+#ifdef _WIN32
+bool midi_mapped_file::open( const char * p_path )
+{
+    close();
+
+    int path_length = MultiByteToWideChar( CP_UTF8, 0, p_path, -1, 0, 0 );
+    if ( path_length <= 0 ) return false;
+    std::vector<wchar_t> path( path_length );
+    MultiByteToWideChar( CP_UTF8, 0, p_path, -1, &path[0], path_length );
+
+    m_file = CreateFileW( &path[0], GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0 );
+    if ( m_file == INVALID_HANDLE_VALUE ) return false;
+
+    LARGE_INTEGER file_size;
+    if ( !GetFileSizeEx( m_file, &file_size ) || (uint64_t) file_size.QuadPart > (std::size_t)-1 )
+    {
+        close();
+        return false;
+    }
+
+    m_size = (std::size_t) file_size.QuadPart;
+    if ( m_size )
+    {
+        m_mapping = CreateFileMappingW( m_file, 0, PAGE_READONLY, 0, 0, 0 );
+        if ( !m_mapping )
+        {
+            close();
+            return false;
+        }
+        m_data = (const uint8_t *) MapViewOfFile( m_mapping, FILE_MAP_READ, 0, 0, 0 );
+        if ( !m_data )
+        {
+            close();
+            return false;
+        }
+    }
+
+    m_open = true;
+    return true;
+}
+
+void midi_mapped_file::close()
+{
+    if ( m_data ) UnmapViewOfFile( m_data );
+    if ( m_mapping ) CloseHandle( m_mapping );
+    if ( m_file != INVALID_HANDLE_VALUE ) CloseHandle( m_file );
+    m_file = INVALID_HANDLE_VALUE;
+    m_mapping = 0;
+    m_data = 0;
+    m_size = 0;
+    m_open = false;
+}
+#else
+bool midi_mapped_file::open( const char * p_path )
+{
+    close();
+
+    int fd = ::open( p_path, O_RDONLY );
+    if ( fd < 0 ) return false;
+
+    struct stat st;
+    if ( fstat( fd, &st ) || !S_ISREG( st.st_mode ) || (uint64_t) st.st_size > (std::size_t)-1 )
+    {
+        ::close( fd );
+        return false;
+    }
+
+    m_size = (std::size_t) st.st_size;
+    if ( m_size )
+    {
+        void * data = mmap( 0, m_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if ( data == MAP_FAILED )
+        {
+            ::close( fd );
+            m_size = 0;
+            return false;
+        }
+        m_data = (const uint8_t *) data;
+    }
+
+    /* The mapping keeps its own reference to the file */
+    ::close( fd );
+
+    m_open = true;
+    return true;
+}
+
+void midi_mapped_file::close()
+{
+    if ( m_data ) munmap( (void *) m_data, m_size );
+    m_data = 0;
+    m_size = 0;
+    m_open = false;
+}
+#endif
+
+bool midi_processor::process_path( const char * p_path, midi_container & p_out )
+{
+    midi_mapped_file mapping;
+    return process_path( p_path, p_out, mapping );
+}
+
+bool midi_processor::process_path( const char * p_path, midi_container & p_out, midi_mapped_file & p_mapping )
+{
+    return process_path( p_path, p_out, p_mapping, midi_processor_options() );
+}
+
+bool midi_processor::process_path( const char * p_path, midi_container & p_out, midi_mapped_file & p_mapping, midi_processor_options const& p_options )
+{
+    if ( !p_mapping.open( p_path ) ) return false;
+
+    const char * extension = "";
+    const char * dot = strrchr( p_path, '.' );
+    if ( dot && !strpbrk( dot, "/\\" ) ) extension = dot + 1;
+
+    return process_file( p_mapping.get_span(), extension, p_out, p_options );
+}
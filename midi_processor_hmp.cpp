@@ -2,7 +2,7 @@
 
 const uint8_t midi_processor::hmp_default_tempo[5] = {0xFF, 0x51, 0x18, 0x80, 0x00};
 
-bool midi_processor::is_hmp( std::vector<uint8_t> const& p_file )
+bool midi_processor::is_hmp( midi_byte_span const& p_file )
 {
     if ( p_file.size() < 8 ) return false;
     if ( p_file[ 0 ] != 'H' || p_file[ 1 ] != 'M' || p_file[ 2 ] != 'I' || p_file[ 3 ] != 'M' ||
@@ -11,23 +11,73 @@ bool midi_processor::is_hmp( std::vector<uint8_t> const& p_file )
     return true;
 }
 
-unsigned midi_processor::decode_hmp_delta( std::vector<uint8_t>::const_iterator & it, std::vector<uint8_t>::const_iterator end )
+unsigned midi_processor::decode_hmp_delta( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator end )
 {
+    midi_byte_span::const_iterator stop = find_delta_stop( it, end, true );
+    if ( stop == end )
+    {
+        it = end;
+        return 0;
+    }
+
 	unsigned delta = 0;
 	unsigned shift = 0;
-	unsigned char byte;
-	do
+    while ( it != stop )
     {
-		if ( it == end ) return 0;
-        byte = *it++;
-		delta = delta + ( ( byte & 0x7F ) << shift );
+		delta = delta + ( ( *it++ & 0x7F ) << shift );
 		shift += 7;
 	}
-	while ( !( byte & 0x80 ) );
+    delta = delta + ( ( *it++ & 0x7F ) << shift );
 	return delta;
 }
 
-bool midi_processor::process_hmp( std::vector<uint8_t> const& p_file, midi_container & p_out )
+bool midi_processor::decode_hmp_track( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator track_end, midi_track_builder & track )
+{
+	unsigned current_timestamp = 0;
+
+    std::vector<uint8_t> _buffer;
+    _buffer.resize( 3 );
+
+    while ( it != track_end )
+	{
+        unsigned delta = decode_hmp_delta( it, track_end );
+		current_timestamp += delta;
+		if ( it == track_end ) return false;
+        _buffer[ 0 ] = *it++;
+		if ( _buffer[ 0 ] == 0xFF )
+		{
+			if ( it == track_end ) return false;
+            _buffer[ 1 ] = *it++;
+            int meta_count = decode_delta( it, track_end );
+            if ( meta_count < 0 ) return false; /*throw exception_io_data( "Invalid HMP meta message" );*/
+			if ( track_end - it < meta_count ) return false;
+            _buffer.resize( meta_count + 2 );
+            std::copy( it, it + meta_count, _buffer.begin() + 2 );
+            it += meta_count;
+            track.add_event( midi_event( current_timestamp, midi_event::extended, 0, &_buffer[0], meta_count + 2 ) );
+			if ( _buffer[ 1 ] == 0x2F ) break;
+		}
+		else if ( _buffer[ 0 ] >= 0x80 && _buffer[ 0 ] <= 0xEF )
+		{
+			unsigned bytes_read = 2;
+			switch ( _buffer[ 0 ] & 0xF0 )
+			{
+			case 0xC0:
+			case 0xD0:
+				bytes_read = 1;
+            }
+			if ( (unsigned long)(track_end - it) < bytes_read ) return false;
+            std::copy( it, it + bytes_read, _buffer.begin() + 1 );
+            it += bytes_read;
+            track.add_event( midi_event( current_timestamp, (midi_event::event_type)( ( _buffer[ 0 ] >> 4 ) - 8 ), _buffer[ 0 ] & 0x0F, &_buffer[1], bytes_read ) );
+		}
+        else return false; /*throw exception_io_data( "Unexpected status code in HMP track" );*/
+	}
+
+    return true;
+}
+
+bool midi_processor::process_hmp( midi_byte_span const& p_file, midi_container & p_out, midi_processor_options const& p_options )
 {
     bool is_funky = p_file[ 7 ] == 'R';
 
@@ -39,8 +89,8 @@ bool midi_processor::process_hmp( std::vector<uint8_t> const& p_file, midi_conta
 	if ( offset >= p_file.size() )
 		return false;
 
-    std::vector<uint8_t>::const_iterator it = p_file.begin() + offset;
-	std::vector<uint8_t>::const_iterator end = p_file.end();
+    midi_byte_span::const_iterator it = p_file.begin() + offset;
+	midi_byte_span::const_iterator end = p_file.end();
 
     track_count_8 = *it;
 
@@ -54,10 +104,10 @@ bool midi_processor::process_hmp( std::vector<uint8_t> const& p_file, midi_conta
 	p_out.initialize( 1, dtx );
 
     {
-		midi_track track;
+		midi_track_builder track( p_out.get_memory_resource() );
 		track.add_event( midi_event( 0, midi_event::extended, 0, hmp_default_tempo, _countof( hmp_default_tempo ) ) );
 		track.add_event( midi_event( 0, midi_event::extended, 0, end_of_track, _countof( end_of_track ) ) );
-		p_out.add_track( track );
+		p_out.add_track( std::move( track.finalize() ) );
 	}
 
     uint8_t buffer[ 4 ];
@@ -88,6 +138,13 @@ bool midi_processor::process_hmp( std::vector<uint8_t> const& p_file, midi_conta
 
 	unsigned track_count = track_count_8;
 
+    /*
+     * Walk the track headers first. A header that does not fit ends the
+     * list, which is not an error.
+     */
+    std::vector<midi_byte_span> track_bodies;
+    track_bodies.reserve( track_count );
+
 	for ( unsigned i = 1; i < track_count; ++i )
 	{
         uint16_t track_size_16;
@@ -99,7 +156,7 @@ bool midi_processor::process_hmp( std::vector<uint8_t> const& p_file, midi_conta
             track_size_16 = it[ 0 ] | ( it[ 1 ] << 8 );
             it += 2;
             track_size_32 = track_size_16 - 4;
-            if ( (unsigned long)(end - it) < track_size_32 + 2 ) break;
+            if ( (uint64_t)(end - it) < (uint64_t) track_size_32 + 2 ) break;
             it += 2;
 		}
 		else
@@ -108,60 +165,56 @@ bool midi_processor::process_hmp( std::vector<uint8_t> const& p_file, midi_conta
             track_size_32 = it[ 0 ] | ( it[ 1 ] << 8 ) | ( it[ 2 ] << 16 ) | ( it[ 3 ] << 24 );
             it += 4;
 			track_size_32 -= 12;
-            if ( (unsigned long)(end - it) < track_size_32 + 8 ) break;
+            if ( (uint64_t)(end - it) < (uint64_t) track_size_32 + 8 ) break;
             it += 4;
 		}
 
-		midi_track track;
+        track_bodies.push_back( midi_byte_span( it, track_size_32 ) );
 
-		unsigned current_timestamp = 0;
+        midi_byte_span::const_iterator track_end = it + track_size_32;
 
-        std::vector<uint8_t> _buffer;
-        _buffer.resize( 3 );
+		offset = is_funky ? 0 : 4;
+		if ( end - track_end < (signed long)offset ) break;
+        it = track_end + offset;
+	}
 
-        std::vector<uint8_t>::const_iterator track_end = it + track_size_32;
+    /*
+     * Without room for the next track's padding, a track whose data runs
+     * to its end fails the file, as it always has.
+     */
+    offset = is_funky ? 0 : 4;
 
-        while ( it != track_end )
-		{
-            unsigned delta = decode_hmp_delta( it, track_end );
-			current_timestamp += delta;
-			if ( it == track_end ) return false;
-            _buffer[ 0 ] = *it++;
-			if ( _buffer[ 0 ] == 0xFF )
-			{
-				if ( it == track_end ) return false;
-                _buffer[ 1 ] = *it++;
-                int meta_count = decode_delta( it, track_end );
-                if ( meta_count < 0 ) return false; /*throw exception_io_data( "Invalid HMP meta message" );*/
-				if ( track_end - it < meta_count ) return false;
-                _buffer.resize( meta_count + 2 );
-                std::copy( it, it + meta_count, _buffer.begin() + 2 );
-                it += meta_count;
-                track.add_event( midi_event( current_timestamp, midi_event::extended, 0, &_buffer[0], meta_count + 2 ) );
-				if ( _buffer[ 1 ] == 0x2F ) break;
-			}
-			else if ( _buffer[ 0 ] >= 0x80 && _buffer[ 0 ] <= 0xEF )
-			{
-				unsigned bytes_read = 2;
-				switch ( _buffer[ 0 ] & 0xF0 )
-				{
-				case 0xC0:
-				case 0xD0:
-					bytes_read = 1;
-                }
-				if ( (unsigned long)(track_end - it) < bytes_read ) return false;
-                std::copy( it, it + bytes_read, _buffer.begin() + 1 );
-                it += bytes_read;
-                track.add_event( midi_event( current_timestamp, (midi_event::event_type)( ( _buffer[ 0 ] >> 4 ) - 8 ), _buffer[ 0 ] & 0x0F, &_buffer[1], bytes_read ) );
-			}
-            else return false; /*throw exception_io_data( "Unexpected status code in HMP track" );*/
-		}
+    std::size_t decoded_count = track_bodies.size();
 
-		offset = is_funky ? 0 : 4;
-		if ( end - it < (signed long)offset ) return false;
-        it = track_end + offset;
+    if ( p_options.m_executor && decoded_count > 1 )
+	{
+        std::vector<midi_track_builder> tracks( decoded_count, midi_track_builder( p_out.get_memory_resource() ) );
+        std::vector<midi_byte_span::const_iterator> track_stops( decoded_count );
+        std::vector<uint8_t> track_valid( decoded_count, 0 );
+
+        p_options.m_executor->run( decoded_count, [&]( std::size_t i )
+        {
+            track_stops[ i ] = track_bodies[ i ].begin();
+            track_valid[ i ] = decode_hmp_track( track_stops[ i ], track_bodies[ i ].end(), tracks[ i ] );
+        } );
 
-		p_out.add_track( track );
+        for ( std::size_t i = 0; i < decoded_count; ++i )
+		{
+            if ( !track_valid[ i ] ) return false;
+            if ( end - track_stops[ i ] < (signed long)offset ) return false;
+            p_out.add_track( std::move( tracks[ i ].finalize() ) );
+		}
+	}
+    else
+	{
+        for ( std::size_t i = 0; i < decoded_count; ++i )
+		{
+            midi_track_builder track( p_out.get_memory_resource() );
+            midi_byte_span::const_iterator track_it = track_bodies[ i ].begin();
+            if ( !decode_hmp_track( track_it, track_bodies[ i ].end(), track ) ) return false;
+            if ( end - track_it < (signed long)offset ) return false;
+            p_out.add_track( std::move( track.finalize() ) );
+		}
 	}
 
     return true;
@@ -2,22 +2,16 @@
 
 #include <string.h>
 
-const uint8_t midi_processor::lds_default_tempo[5] = { 0xFF, 0x51, 0x07, 0xA1, 0x20 };
+#include <algorithm>
 
-#define ENABLE_WHEEL
-//#define ENABLE_VIB
-//#define ENABLE_ARP
-//#define ENABLE_TREM
+const uint8_t midi_processor::lds_default_tempo[5] = { 0xFF, 0x51, 0x07, 0xA1, 0x20 };
 
-#ifdef ENABLE_WHEEL
 #define WHEEL_RANGE_HIGH 12
 #define WHEEL_RANGE_LOW 0
 #define WHEEL_SCALE(x) ((x) * 512 / WHEEL_RANGE_HIGH)
 #define WHEEL_SCALE_LOW(x) (WHEEL_SCALE(x) & 127)
 #define WHEEL_SCALE_HIGH(x) (((WHEEL_SCALE(x) >> 7) + 64) & 127)
-#endif
 
-#ifdef ENABLE_VIB
 // Vibrato (sine) table
 static const unsigned char vibtab[] = {
   0, 13, 25, 37, 50, 62, 74, 86, 98, 109, 120, 131, 142, 152, 162,
@@ -26,9 +20,7 @@ static const unsigned char vibtab[] = {
   231, 225, 219, 212, 205, 197, 189, 180, 171, 162, 152, 142, 131,
   120, 109, 98, 86, 74, 62, 50, 37, 25, 13
 };
-#endif
 
-#ifdef ENABLE_TREM
 // Tremolo (sine * sine) table
 static const unsigned char tremtab[] = {
   0, 0, 1, 1, 2, 4, 5, 7, 10, 12, 15, 18, 21, 25, 29, 33, 37, 42, 47,
@@ -41,9 +33,8 @@ static const unsigned char tremtab[] = {
   109, 103, 97, 90, 85, 79, 73, 67, 62, 57, 52, 47, 42, 37, 33, 29,
   25, 21, 18, 15, 12, 10, 7, 5, 4, 2, 1, 1, 0
 };
-#endif
 
-bool midi_processor::is_lds( std::vector<uint8_t> const& p_file, const char * p_extension )
+bool midi_processor::is_lds( midi_byte_span const& p_file, const char * p_extension )
 {
     if ( strcasecmp( p_extension, "LDS" ) ) return false;
     if ( p_file.size() < 1 ) return false;
@@ -55,24 +46,16 @@ struct sound_patch
 {
 	// skip 11 bytes worth of Adlib crap
     uint8_t keyoff;
-#ifdef ENABLE_WHEEL
     uint8_t portamento;
     int8_t glide;
-#endif
 	// skip 1 byte
-#ifdef ENABLE_VIB
     uint8_t vibrato;
     uint8_t vibrato_delay;
-#endif
-#ifdef ENABLE_TREM
     uint8_t modulator_tremolo;
     uint8_t carrier_tremolo;
     uint8_t tremolo_delay;
-#endif
-#ifdef ENABLE_ARP
     uint8_t arpeggio;
     int8_t arpeggio_table[12];
-#endif
 	// skip 4 bytes worth of digital instrument crap
 	// skip 3 more bytes worth of Adlib crap that isn't even used
     uint8_t midi_instrument;
@@ -83,27 +66,17 @@ struct sound_patch
 };
 
 struct channel_state {
-#ifdef ENABLE_WHEEL
     int16_t gototune, lasttune;
-#endif
     uint16_t packpos;
     int8_t finetune;
-#ifdef ENABLE_WHEEL
     uint8_t glideto, portspeed;
-#endif
     uint8_t nextvol, volmod, volcar,
 		keycount, packwait;
-#ifdef ENABLE_VIB
     uint8_t vibwait, vibspeed, vibrate, vibcount;
-#endif
-#ifdef ENABLE_TREM
     uint8_t trmstay, trmwait, trmspeed, trmrate, trmcount,
 		trcwait, trcspeed, trcrate, trccount;
-#endif
-#ifdef ENABLE_ARP
     uint8_t arp_count, arp_size, arp_speed, arp_pos;
     int8_t arp_tab[12];
-#endif
 
 	struct {
         uint8_t chandelay, sound;
@@ -111,11 +84,14 @@ struct channel_state {
 	} chancheat;
 };
 
-void playsound( uint8_t current_instrument[], std::vector<sound_patch> const& patches, uint8_t last_note[], uint8_t last_channel[], uint8_t last_instrument[], uint8_t last_volume[], uint8_t last_sent_volume[],
-#ifdef ENABLE_WHEEL
-    int16_t last_pitch_wheel[],
-#endif
-    channel_state * c, uint8_t allvolume, unsigned current_timestamp, unsigned sound, unsigned chan, unsigned high, midi_track & track )
+/*
+ * The enable_ parameters select which Adlib effects are emulated. Each
+ * combination is compiled separately, so code for the disabled effects
+ * folds away instead of being tested on every note and tick.
+ */
+template <bool enable_wheel, bool enable_vib, bool enable_trem, bool enable_arp>
+static void playsound( uint8_t current_instrument[], std::vector<sound_patch> const& patches, uint8_t last_note[], uint8_t last_channel[], uint8_t last_instrument[], uint8_t last_volume[], uint8_t last_sent_volume[],
+    int16_t last_pitch_wheel[], channel_state * c, uint8_t allvolume, unsigned current_timestamp, unsigned sound, unsigned chan, unsigned high, midi_track_builder & track )
 {
     uint8_t buffer[ 2 ];
 	current_instrument[ chan ] = sound;
@@ -131,34 +107,28 @@ void playsound( uint8_t current_instrument[], std::vector<sound_patch> const& pa
 		high += c->finetune;
 
 		// arpeggio handling
-#ifdef ENABLE_ARP
-		if(patch.arpeggio)
+		if(enable_arp && patch.arpeggio)
 		{
 			short arpcalc = patch.arpeggio_table[0] << 4;
 
 			high += arpcalc;
 		}
-#endif
 
 		// and MIDI transpose
 		high = (int)high + ( patch.midi_transpose << 4 );
 
-		note = high
-#ifdef ENABLE_WHEEL
-			- c->lasttune
-#endif
-			;
+		note = high;
+		if(enable_wheel)
+			note -= c->lasttune;
 
 		// glide handling
-#ifdef ENABLE_WHEEL
-		if(c->glideto != 0)
+		if(enable_wheel && c->glideto != 0)
 		{
 			c->gototune = note - ( last_note[ chan ] << 4 ) + c->lasttune;
 			c->portspeed = c->glideto;
 			c->glideto = c->finetune = 0;
 			return;
 		}
-#endif
 
 		if ( patch.midi_instrument != last_instrument[ chan ] )
 		{
@@ -199,8 +169,7 @@ void playsound( uint8_t current_instrument[], std::vector<sound_patch> const& pa
 		buffer[ 1 ] = 127;
 		track.add_event( midi_event( current_timestamp, midi_event::note_off, last_channel[ chan ], buffer, 2 ) );
 		last_note[ chan ] = 0xFF;
-#ifdef ENABLE_WHEEL
-		if ( channel != 9 )
+		if ( enable_wheel && channel != 9 )
 		{
 			note += c->lasttune;
 			c->lasttune = 0;
@@ -212,33 +181,26 @@ void playsound( uint8_t current_instrument[], std::vector<sound_patch> const& pa
 				last_pitch_wheel[ channel ] = 0;
 			}
 		}
-#endif
 	}
-#ifdef ENABLE_WHEEL
-	if ( c->lasttune != last_pitch_wheel[ channel ] )
+	if ( enable_wheel && c->lasttune != last_pitch_wheel[ channel ] )
 	{
 		buffer[ 0 ] = WHEEL_SCALE_LOW( c->lasttune );
 		buffer[ 1 ] = WHEEL_SCALE_HIGH( c->lasttune );
 		track.add_event( midi_event( current_timestamp, midi_event::pitch_wheel, channel, buffer, 2 ) );
 		last_pitch_wheel[ channel ] = c->lasttune;
 	}
-	if( !patch.glide || last_note[ chan ] == 0xFF )
-#endif
+	if( !enable_wheel || !patch.glide || last_note[ chan ] == 0xFF )
 	{
-#ifdef ENABLE_WHEEL
-		if( !patch.portamento || last_note[ chan ] == 0xFF )
-#endif
+		if( !enable_wheel || !patch.portamento || last_note[ chan ] == 0xFF )
 		{
 			buffer[ 0 ] = note >> 4;
 			buffer[ 1 ] = patch.midi_velocity;
 			track.add_event( midi_event( current_timestamp, midi_event::note_on, channel, buffer, 2 ) );
 			last_note[ chan ] = note >> 4;
 			last_channel[ chan ] = channel;
-#ifdef ENABLE_WHEEL
-			c->gototune = c->lasttune;
-#endif
+			if ( enable_wheel )
+				c->gototune = c->lasttune;
 		}
-#ifdef ENABLE_WHEEL
 		else
 		{
             c->gototune = note - ( last_note[ chan ] << 4 ) + c->lasttune;
@@ -247,9 +209,7 @@ void playsound( uint8_t current_instrument[], std::vector<sound_patch> const& pa
 			buffer[ 1 ] = patch.midi_velocity;
 			track.add_event( midi_event( current_timestamp, midi_event::note_on, channel, buffer, 2 ) );
 		}
-#endif
 	}
-#ifdef ENABLE_WHEEL
 	else
 	{
 		buffer[ 0 ] = note >> 4;
@@ -260,59 +220,60 @@ void playsound( uint8_t current_instrument[], std::vector<sound_patch> const& pa
 		c->gototune = patch.glide;
 		c->portspeed = patch.portamento;
 	}
-#endif
 
-#ifdef ENABLE_VIB
-	if(!patch.vibrato)
-	{
-		c->vibwait = c->vibspeed = c->vibrate = 0;
-	}
-	else
+	if ( enable_vib )
 	{
-		c->vibwait = patch.vibrato_delay;
-		// PASCAL:    c->vibspeed = ((i->vibrato >> 4) & 15) + 1;
-		c->vibspeed = (patch.vibrato >> 4) + 2;
-		c->vibrate = (patch.vibrato & 15) + 1;
+		if(!patch.vibrato)
+		{
+			c->vibwait = c->vibspeed = c->vibrate = 0;
+		}
+		else
+		{
+			c->vibwait = patch.vibrato_delay;
+			// PASCAL:    c->vibspeed = ((i->vibrato >> 4) & 15) + 1;
+			c->vibspeed = (patch.vibrato >> 4) + 2;
+			c->vibrate = (patch.vibrato & 15) + 1;
+		}
 	}
-#endif
 
-#ifdef ENABLE_TREM
-	if(!(c->trmstay & 0xf0))
+	if ( enable_trem )
 	{
-		c->trmwait = (patch.tremolo_delay & 0xf0) >> 3;
-		// PASCAL:    c->trmspeed = (i->mod_trem >> 4) & 15;
-		c->trmspeed = patch.modulator_tremolo >> 4;
-		c->trmrate = patch.modulator_tremolo & 15;
-		c->trmcount = 0;
+		if(!(c->trmstay & 0xf0))
+		{
+			c->trmwait = (patch.tremolo_delay & 0xf0) >> 3;
+			// PASCAL:    c->trmspeed = (i->mod_trem >> 4) & 15;
+			c->trmspeed = patch.modulator_tremolo >> 4;
+			c->trmrate = patch.modulator_tremolo & 15;
+			c->trmcount = 0;
+		}
+
+		if(!(c->trmstay & 0x0f))
+		{
+			c->trcwait = (patch.tremolo_delay & 15) << 1;
+			// PASCAL:    c->trcspeed = (i->car_trem >> 4) & 15;
+			c->trcspeed = patch.carrier_tremolo >> 4;
+			c->trcrate = patch.carrier_tremolo & 15;
+			c->trccount = 0;
+		}
 	}
 
-	if(!(c->trmstay & 0x0f))
+	if ( enable_arp )
 	{
-		c->trcwait = (patch.tremolo_delay & 15) << 1;
-		// PASCAL:    c->trcspeed = (i->car_trem >> 4) & 15;
-		c->trcspeed = patch.carrier_tremolo >> 4;
-		c->trcrate = patch.carrier_tremolo & 15;
-		c->trccount = 0;
+		c->arp_size = std::min<uint8_t>( patch.arpeggio & 15, 12 );
+		c->arp_speed = patch.arpeggio >> 4;
+		memcpy(c->arp_tab, patch.arpeggio_table, 12);
+		c->arp_pos = c->arp_count = 0;
 	}
-#endif
-
-#ifdef ENABLE_ARP
-	c->arp_size = patch.arpeggio & 15;
-	c->arp_speed = patch.arpeggio >> 4;
-	memcpy(c->arp_tab, patch.arpeggio_table, 12);
-	c->arp_pos = c->arp_count = 0;
-#endif
-#ifdef ENABLE_VIB
-	c->vibcount = 0;
-#endif
-#ifdef ENABLE_WHEEL
-	c->glideto = 0;
-#endif
+	if ( enable_vib )
+		c->vibcount = 0;
+	if ( enable_wheel )
+		c->glideto = 0;
 	c->keycount = patch.keyoff;
 	c->nextvol = c->finetune = 0;
 }
 
-bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_container & p_out )
+template <bool enable_wheel, bool enable_vib, bool enable_trem, bool enable_arp>
+bool midi_processor::process_lds_emulated( midi_byte_span const& p_file, midi_container & p_out )
 {
 	struct position_data
 	{
@@ -333,8 +294,8 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
     std::size_t pattern_count;
     std::vector<uint16_t> patterns;
 
-    std::vector<uint8_t>::const_iterator it = p_file.begin();
-	std::vector<uint8_t>::const_iterator end = p_file.end();
+    midi_byte_span::const_iterator it = p_file.begin();
+	midi_byte_span::const_iterator end = p_file.end();
 
 	if ( end == it ) return false;
     mode = *it++;
@@ -360,47 +321,29 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 		sound_patch & patch = patches[ i ];
         it += 11;
         patch.keyoff = *it++;
-#ifdef ENABLE_WHEEL
         patch.portamento = *it++;
         patch.glide = *it++;
         it++;
-#else
-        it += 3;
-#endif
-#ifdef ENABLE_VIB
         patch.vibrato = *it++;
         patch.vibrato_delay = *it++;
-#else
-        it += 2;
-#endif
-#ifdef ENABLE_TREM
         patch.modulator_tremolo = *it++;
         patch.carrier_tremolo = *it++;
         patch.tremolo_delay = *it++;
-#else
-        it += 3;
-#endif
-#ifdef ENABLE_ARP
         patch.arpeggio = *it++;
 		for ( unsigned j = 0; j < 12; ++j )
             patch.arpeggio_table[ j ] = *it++;
         it += 7;
-#else
-        it += 20;
-#endif
         patch.midi_instrument = *it++;
         patch.midi_velocity = *it++;
         patch.midi_key = *it++;
         patch.midi_transpose = *it++;
         it += 2;
 
-#ifdef ENABLE_WHEEL
 		// hax
 		if ( patch.midi_instrument >= 0x80 )
 		{
 			patch.glide = 0;
 		}
-#endif
 	}
 
 	if ( end - it < 2 ) return false;
@@ -448,9 +391,7 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
     uint8_t last_note[9];
     uint8_t last_volume[9];
     uint8_t last_sent_volume[11];
-#ifdef ENABLE_WHEEL
     int16_t last_pitch_wheel[11];
-#endif
     uint8_t ticks_without_notes[11];
 
 	memset( last_channel, 0, sizeof( last_channel ) );
@@ -458,9 +399,7 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 	memset( last_note, 0xFF, sizeof( last_note ) );
 	memset( last_volume, 127, sizeof( last_volume ) );
 	memset( last_sent_volume, 127, sizeof( last_sent_volume ) );
-#ifdef ENABLE_WHEEL
 	memset( last_pitch_wheel, 0, sizeof( last_pitch_wheel ) );
-#endif
 	memset( ticks_without_notes, 0, sizeof( ticks_without_notes ) );
 
 	unsigned current_timestamp = 0;
@@ -470,7 +409,7 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 	p_out.initialize( 1, 35 );
 
 	{
-		midi_track track;
+		midi_track_builder track( p_out.get_memory_resource() );
 		track.add_event( midi_event( 0, midi_event::extended, 0, lds_default_tempo, _countof( lds_default_tempo ) ) );
 		for ( unsigned i = 0; i < 11; ++i )
 		{
@@ -479,29 +418,30 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 			track.add_event( midi_event( 0, midi_event::control_change, i, buffer, 2 ) );
 			buffer[ 0 ] = 121;
 			track.add_event( midi_event( 0, midi_event::control_change, i, buffer, 2 ) );
-#ifdef ENABLE_WHEEL
-			buffer[ 0 ] = 0x65;
-			track.add_event( midi_event( 0, midi_event::control_change, i, buffer, 2 ) );
-			buffer[ 0 ] = 0x64;
-			track.add_event( midi_event( 0, midi_event::control_change, i, buffer, 2 ) );
-			buffer[ 0 ] = 0x06;
-			buffer[ 1 ] = WHEEL_RANGE_HIGH;
-			track.add_event( midi_event( 0, midi_event::control_change, i, buffer, 2 ) );
-			buffer[ 0 ] = 0x26;
-			buffer[ 1 ] = WHEEL_RANGE_LOW;
-			track.add_event( midi_event( 0, midi_event::control_change, i, buffer, 2 ) );
-			buffer[ 0 ] = 0;
-			buffer[ 1 ] = 64;
-			track.add_event( midi_event( 0, midi_event::pitch_wheel, i, buffer, 2 ) );
-#endif
+			if ( enable_wheel )
+			{
+				buffer[ 0 ] = 0x65;
+				track.add_event( midi_event( 0, midi_event::control_change, i, buffer, 2 ) );
+				buffer[ 0 ] = 0x64;
+				track.add_event( midi_event( 0, midi_event::control_change, i, buffer, 2 ) );
+				buffer[ 0 ] = 0x06;
+				buffer[ 1 ] = WHEEL_RANGE_HIGH;
+				track.add_event( midi_event( 0, midi_event::control_change, i, buffer, 2 ) );
+				buffer[ 0 ] = 0x26;
+				buffer[ 1 ] = WHEEL_RANGE_LOW;
+				track.add_event( midi_event( 0, midi_event::control_change, i, buffer, 2 ) );
+				buffer[ 0 ] = 0;
+				buffer[ 1 ] = 64;
+				track.add_event( midi_event( 0, midi_event::pitch_wheel, i, buffer, 2 ) );
+			}
 		}
 		track.add_event( midi_event( 0, midi_event::extended, 0, end_of_track, _countof( end_of_track ) ) );
-		p_out.add_track( track );
+		p_out.add_track( std::move( track.finalize() ) );
 	}
 
-    std::vector<midi_track> tracks;
+    std::vector<midi_track_builder> tracks;
 	{
-		midi_track track;
+		midi_track_builder track( p_out.get_memory_resource() );
 		track.add_event( midi_event( 0, midi_event::extended, 0, end_of_track, _countof( end_of_track ) ) );
         tracks.resize( 10, track );
 	}
@@ -524,18 +464,10 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 	while ( playing )
 	{
         uint16_t        chan;
-#ifdef ENABLE_VIB
         uint16_t        wibc;
-#endif
-#if defined(ENABLE_VIB) || defined(ENABLE_ARP)
         int16_t         tune;
-#endif
-#ifdef ENABLE_ARP
         int16_t         arpreg;
-#endif
-#ifdef ENABLE_TREM
         uint16_t        tremc;
-#endif
 		bool            vbreak;
 		unsigned        i;
 		channel_state * c;
@@ -580,11 +512,8 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 			{
 				if(!(--_c->chancheat.chandelay))
 				{
-					playsound( current_instrument, patches, last_note, last_channel, last_instrument, last_volume, last_sent_volume,
-#ifdef ENABLE_WHEEL
-						last_pitch_wheel,
-#endif
-						_c, allvolume, current_timestamp, _c->chancheat.sound, chan, _c->chancheat.high, tracks[ chan ] );
+					playsound<enable_wheel, enable_vib, enable_trem, enable_arp>( current_instrument, patches, last_note, last_channel, last_instrument, last_volume, last_sent_volume,
+						last_pitch_wheel, _c, allvolume, current_timestamp, _c->chancheat.sound, chan, _c->chancheat.high, tracks[ chan ] );
 					ticks_without_notes[ last_channel[ chan ] ] = 0;
 				}
 			}
@@ -663,22 +592,21 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 								}
 								break;
 							case 0xf8:
-#ifdef ENABLE_WHEEL
-								_c->lasttune = 0;
-#endif
+								if(enable_wheel)
+									_c->lasttune = 0;
 								break;
 							case 0xf7:
-#ifdef ENABLE_VIB
-								_c->vibwait = 0;
-								// PASCAL: _c->vibspeed = ((comlo >> 4) & 15) + 2;
-								_c->vibspeed = (comlo >> 4) + 2;
-								_c->vibrate = (comlo & 15) + 1;
-#endif
+								if(enable_vib)
+								{
+									_c->vibwait = 0;
+									// PASCAL: _c->vibspeed = ((comlo >> 4) & 15) + 2;
+									_c->vibspeed = (comlo >> 4) + 2;
+									_c->vibrate = (comlo & 15) + 1;
+								}
 								break;
 							case 0xf6:
-#ifdef ENABLE_WHEEL
-								_c->glideto = comlo;
-#endif
+								if(enable_wheel)
+									_c->glideto = comlo;
 								break;
 							case 0xf5:
 								_c->finetune = comlo;
@@ -693,9 +621,8 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 								if(!hardfade) fadeonoff = comlo;
 								break;
 							case 0xf2:
-#ifdef ENABLE_TREM
-								_c->trmstay = comlo;
-#endif
+								if(enable_trem)
+									_c->trmstay = comlo;
 								break;
 							case 0xf1:
 								buffer[ 0 ] = 10;
@@ -707,10 +634,8 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 								tracks[ _chan ].add_event( midi_event( current_timestamp, midi_event::program_change, last_channel[ _chan ], buffer, 1 ) );
 								break;
 							default:
-#ifdef ENABLE_WHEEL
-								if(comhi < 0xa0)
+								if(enable_wheel && comhi < 0xa0)
 									_c->glideto = comhi & 0x1f;
-#endif
 								break;
 							}
 						}
@@ -737,11 +662,8 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 
 							if( !channel_delay[ _chan ] )
 							{
-								playsound( current_instrument, patches, last_note, last_channel, last_instrument, last_volume, last_sent_volume,
-#ifdef ENABLE_WHEEL
-									last_pitch_wheel,
-#endif
-									_c, allvolume, current_timestamp, sound, _chan, high, tracks[ _chan ] );
+								playsound<enable_wheel, enable_vib, enable_trem, enable_arp>( current_instrument, patches, last_note, last_channel, last_instrument, last_volume, last_sent_volume,
+									last_pitch_wheel, _c, allvolume, current_timestamp, sound, _chan, high, tracks[ _chan ] );
 								ticks_without_notes[ last_channel[ _chan ] ] = 0;
 							}
 							else
@@ -806,8 +728,7 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 					buffer[ 1 ] = 127;
 					tracks[ chan ].add_event( midi_event( current_timestamp, midi_event::note_off, last_channel[ chan ], buffer, 2 ) );
 					last_note[ chan ] = 0xFF;
-#ifdef ENABLE_WHEEL
-					if ( 0 != last_pitch_wheel[ last_channel[ chan ] ] )
+					if ( enable_wheel && 0 != last_pitch_wheel[ last_channel[ chan ] ] )
 					{
 						buffer[ 0 ] = 0;
 						buffer[ 1 ] = 64;
@@ -816,18 +737,13 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 						c->lasttune = 0;
 						c->gototune = 0;
 					}
-#endif
 				}
 				c->keycount--;
 			}
 
-#ifdef ENABLE_ARP
 			// arpeggio
-			if(c->arp_size == 0)
-			{
-				arpreg = 0;
-			}
-			else
+			arpreg = 0;
+			if(enable_arp && c->arp_size != 0)
 			{
 				arpreg = c->arp_tab[c->arp_pos] << 4;
 				if(arpreg == -0x800)
@@ -847,11 +763,9 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 					c->arp_count++;
 				}
 			}
-#endif
 
-#ifdef ENABLE_WHEEL
 			// glide & portamento
-			if(c->lasttune != c->gototune)
+			if(enable_wheel && c->lasttune != c->gototune)
 			{
 				if(c->lasttune > c->gototune)
 				{
@@ -876,12 +790,7 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 					}
 				}
 
-#ifdef ENABLE_ARP
-				arpreg +=
-#else
-                int16_t arpreg =
-#endif
-					c->lasttune;
+				arpreg += c->lasttune;
 
 				if ( arpreg != last_pitch_wheel[ last_channel[ chan ] ] )
 				{
@@ -890,129 +799,116 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 					tracks[ chan ].add_event( midi_event( current_timestamp, midi_event::pitch_wheel, last_channel[ chan ], buffer, 2 ) );
 					last_pitch_wheel[ last_channel[ chan ] ] = arpreg;
 				}
-			} else
+			}
+			else if(enable_wheel && enable_vib && !c->vibwait)
 			{
-#ifdef ENABLE_VIB
 				// vibrato
-				if(!c->vibwait)
+				if(c->vibrate)
 				{
-					if(c->vibrate)
-					{
-						wibc = vibtab[c->vibcount & 0x3f] * c->vibrate;
+					wibc = vibtab[c->vibcount & 0x3f] * c->vibrate;
 
-						if((c->vibcount & 0x40) == 0)
-							tune = c->lasttune + (wibc >> 8);
-						else
-							tune = c->lasttune - (wibc >> 8);
-
-#ifdef ENABLE_ARP
-						tune += arpreg;
-#endif
+					if((c->vibcount & 0x40) == 0)
+						tune = c->lasttune + (wibc >> 8);
+					else
+						tune = c->lasttune - (wibc >> 8);
 
-						if ( tune != last_pitch_wheel[ last_channel[ chan ] ] )
-						{
-							buffer[ 0 ] = WHEEL_SCALE_LOW( tune );
-							buffer[ 1 ] = WHEEL_SCALE_HIGH( tune );
-							tracks[ chan ].add_event( midi_event( current_timestamp, midi_event::pitch_wheel, last_channel[ chan ], buffer, 2 ) );
-							last_pitch_wheel[ last_channel[ chan ] ] = tune;
-						}
+					tune += arpreg;
 
-						c->vibcount += c->vibspeed;
+					if ( tune != last_pitch_wheel[ last_channel[ chan ] ] )
+					{
+						buffer[ 0 ] = WHEEL_SCALE_LOW( tune );
+						buffer[ 1 ] = WHEEL_SCALE_HIGH( tune );
+						tracks[ chan ].add_event( midi_event( current_timestamp, midi_event::pitch_wheel, last_channel[ chan ], buffer, 2 ) );
+						last_pitch_wheel[ last_channel[ chan ] ] = tune;
 					}
-#ifdef ENABLE_ARP
-					else if(c->arp_size != 0)
-					{	// no vibrato, just arpeggio
-						tune = c->lasttune + arpreg;
 
-						if ( tune != last_pitch_wheel[ last_channel[ chan ] ] )
-						{
-							buffer[ 0 ] = WHEEL_SCALE_LOW( tune );
-							buffer[ 1 ] = WHEEL_SCALE_HIGH( tune );
-							tracks[ chan ].add_event( midi_event( current_timestamp, midi_event::pitch_wheel, last_channel[ chan ], buffer, 2 ) );
-							last_pitch_wheel[ last_channel[ chan ] ] = tune;
-						}
-					}
-#endif
+					c->vibcount += c->vibspeed;
 				}
-#ifdef ENABLE_ARP
-				else
-#endif
-#endif
-#ifdef ENABLE_ARP
+				else if(enable_arp && c->arp_size != 0)
 				{	// no vibrato, just arpeggio
-#ifdef ENABLE_VIB
-					c->vibwait--;
-#endif
+					tune = c->lasttune + arpreg;
 
-					if(c->arp_size != 0)
+					if ( tune != last_pitch_wheel[ last_channel[ chan ] ] )
 					{
-						tune = c->lasttune + arpreg;
-
-						if ( tune != last_pitch_wheel[ last_channel[ chan ] ] )
-						{
-							buffer[ 0 ] = WHEEL_SCALE_LOW( tune );
-							buffer[ 1 ] = WHEEL_SCALE_HIGH( tune );
-							tracks[ chan ].add_event( midi_event( current_timestamp, midi_event::pitch_wheel, last_channel[ chan ], buffer, 2 ) );
-							last_pitch_wheel[ last_channel[ chan ] ] = tune;
-						}
+						buffer[ 0 ] = WHEEL_SCALE_LOW( tune );
+						buffer[ 1 ] = WHEEL_SCALE_HIGH( tune );
+						tracks[ chan ].add_event( midi_event( current_timestamp, midi_event::pitch_wheel, last_channel[ chan ], buffer, 2 ) );
+						last_pitch_wheel[ last_channel[ chan ] ] = tune;
 					}
 				}
-#endif
 			}
-#endif
-
-#ifdef ENABLE_TREM
-			unsigned volume = last_volume[ chan ];
+			else if(enable_wheel && enable_arp)
+			{	// no vibrato, just arpeggio
+				if(enable_vib)
+					c->vibwait--;
 
-			// tremolo (modulator)
-			if(!c->trmwait)
-			{
-				if(c->trmrate)
+				if(c->arp_size != 0)
 				{
-					tremc = tremtab[c->trmcount & 0x7f] * c->trmrate;
-					if((tremc >> 7) <= volume)
-						volume = volume - (tremc >> 7);
-					else
-						volume = 0;
+					tune = c->lasttune + arpreg;
 
-					c->trmcount += c->trmspeed;
+					if ( tune != last_pitch_wheel[ last_channel[ chan ] ] )
+					{
+						buffer[ 0 ] = WHEEL_SCALE_LOW( tune );
+						buffer[ 1 ] = WHEEL_SCALE_HIGH( tune );
+						tracks[ chan ].add_event( midi_event( current_timestamp, midi_event::pitch_wheel, last_channel[ chan ], buffer, 2 ) );
+						last_pitch_wheel[ last_channel[ chan ] ] = tune;
+					}
 				}
 			}
-			else
-			{
-				c->trmwait--;
-			}
 
-			// tremolo (carrier)
-			if(!c->trcwait)
+			if(enable_trem)
 			{
-				if(c->trcrate)
+				unsigned volume = last_volume[ chan ];
+
+				// tremolo (modulator)
+				if(!c->trmwait)
 				{
-					tremc = tremtab[c->trccount & 0x7f] * c->trcrate;
-					if((tremc >> 7) <= volume)
-						volume = volume - (tremc >> 8);
-					else
-						volume = 0;
+					if(c->trmrate)
+					{
+						tremc = tremtab[c->trmcount & 0x7f] * c->trmrate;
+						if((tremc >> 7) <= volume)
+							volume = volume - (tremc >> 7);
+						else
+							volume = 0;
+
+						c->trmcount += c->trmspeed;
+					}
+				}
+				else
+				{
+					c->trmwait--;
 				}
-			}
-			else
-			{
-				c->trcwait--;
-			}
 
-			if ( allvolume )
-			{
-				volume = volume * allvolume / 255;
-			}
+				// tremolo (carrier)
+				if(!c->trcwait)
+				{
+					if(c->trcrate)
+					{
+						tremc = tremtab[c->trccount & 0x7f] * c->trcrate;
+						if((tremc >> 7) <= volume)
+							volume = volume - (tremc >> 8);
+						else
+							volume = 0;
+					}
+				}
+				else
+				{
+					c->trcwait--;
+				}
 
-			if ( volume != last_sent_volume[ last_channel[ chan ] ] )
-			{
-				buffer[ 0 ] = 7;
-				buffer[ 1 ] = volume;
-				tracks[ chan ].add_event( midi_event( current_timestamp, midi_event::control_change, last_channel[ chan ], buffer, 2 ) );
-				last_sent_volume[ last_channel[ chan ] ] = volume;
+				if ( allvolume )
+				{
+					volume = volume * allvolume / 255;
+				}
+
+				if ( volume != last_sent_volume[ last_channel[ chan ] ] )
+				{
+					buffer[ 0 ] = 7;
+					buffer[ 1 ] = volume;
+					tracks[ chan ].add_event( midi_event( current_timestamp, midi_event::control_change, last_channel[ chan ], buffer, 2 ) );
+					last_sent_volume[ last_channel[ chan ] ] = volume;
+				}
 			}
-#endif
 
 		}
 
@@ -1023,7 +919,7 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 
 	for ( unsigned i = 0; i < 9; ++i )
 	{
-		midi_track & track = tracks[ i ];
+		midi_track_builder & track = tracks[ i ];
 		unsigned long count = track.get_count();
 		if ( count > 1 )
 		{
@@ -1032,18 +928,47 @@ bool midi_processor::process_lds( std::vector<uint8_t> const& p_file, midi_conta
 				buffer[ 0 ] = last_note[ i ];
 				buffer[ 1 ] = 127;
 				track.add_event( midi_event( current_timestamp + channel[ i ].keycount, midi_event::note_off, last_channel[ i ], buffer, 2 ) );
-#ifdef ENABLE_WHEEL
-				if ( last_pitch_wheel[ last_channel[ i ] ] != 0 )
+				if ( enable_wheel && last_pitch_wheel[ last_channel[ i ] ] != 0 )
 				{
 					buffer[ 0 ] = 0;
 					buffer[ 1 ] = 0x40;
 					track.add_event( midi_event( current_timestamp + channel[ i ].keycount, midi_event::pitch_wheel, last_channel[ i ], buffer, 2 ) );
 				}
-#endif
 			}
-			p_out.add_track( track );
+			p_out.add_track( std::move( track.finalize() ) );
 		}
 	}
 
     return true;
 }
+
+bool midi_processor::process_lds( midi_byte_span const& p_file, midi_container & p_out, midi_processor_options const& p_options )
+{
+    typedef bool (*lds_emulation)( midi_byte_span const& p_file, midi_container & p_out );
+
+    /* Indexed by wheel | vibrato << 1 | tremolo << 2 | arpeggio << 3 */
+    static const lds_emulation emulations[ 16 ] =
+    {
+        &process_lds_emulated<false, false, false, false>,
+        &process_lds_emulated<true,  false, false, false>,
+        &process_lds_emulated<false, true,  false, false>,
+        &process_lds_emulated<true,  true,  false, false>,
+        &process_lds_emulated<false, false, true,  false>,
+        &process_lds_emulated<true,  false, true,  false>,
+        &process_lds_emulated<false, true,  true,  false>,
+        &process_lds_emulated<true,  true,  true,  false>,
+        &process_lds_emulated<false, false, false, true>,
+        &process_lds_emulated<true,  false, false, true>,
+        &process_lds_emulated<false, true,  false, true>,
+        &process_lds_emulated<true,  true,  false, true>,
+        &process_lds_emulated<false, false, true,  true>,
+        &process_lds_emulated<true,  false, true,  true>,
+        &process_lds_emulated<false, true,  true,  true>,
+        &process_lds_emulated<true,  true,  true,  true>
+    };
+
+    unsigned index = ( p_options.m_lds_pitch_wheel ? 1 : 0 ) | ( p_options.m_lds_vibrato ? 2 : 0 ) |
+                     ( p_options.m_lds_tremolo ? 4 : 0 ) | ( p_options.m_lds_arpeggio ? 8 : 0 );
+
+    return emulations[ index ]( p_file, p_out );
+}
@@ -1,6 +1,6 @@
 #include "midi_processor.h"
 
-bool midi_processor::is_mids( std::vector<uint8_t> const& p_file )
+bool midi_processor::is_mids( midi_byte_span const& p_file )
 {
     if ( p_file.size() < 8 ) return false;
     if ( p_file[ 0 ] != 'R' || p_file[ 1 ] != 'I' || p_file[ 2 ] != 'F' || p_file[ 3 ] != 'F' ) return false;
@@ -11,11 +11,11 @@ bool midi_processor::is_mids( std::vector<uint8_t> const& p_file )
     return true;
 }
 
-bool midi_processor::process_mids( std::vector<uint8_t> const& p_file, midi_container & p_out )
+bool midi_processor::process_mids( midi_byte_span const& p_file, midi_container & p_out )
 {
 	if ( p_file.size() < 20 ) return false;
-    std::vector<uint8_t>::const_iterator it = p_file.begin() + 16;
-	std::vector<uint8_t>::const_iterator end = p_file.end();
+    midi_byte_span::const_iterator it = p_file.begin() + 16;
+	midi_byte_span::const_iterator end = p_file.end();
 
     uint32_t fmt_size = it[ 0 ] | ( it[ 1 ] << 8 ) | ( it[ 2 ] << 16 ) | ( it[ 3 ] << 24 );
     it += 4;
@@ -56,16 +56,16 @@ bool midi_processor::process_mids( std::vector<uint8_t> const& p_file, midi_cont
     it += 4;
 
 	{
-		midi_track track;
+		midi_track_builder track( p_out.get_memory_resource() );
 		track.add_event( midi_event( 0, midi_event::extended, 0, end_of_track, _countof( end_of_track ) ) );
-		p_out.add_track( track );
+		p_out.add_track( std::move( track.finalize() ) );
 	}
 
 	if ( end - it < 4 ) return false;
     uint32_t data_size = it[ 0 ] | ( it[ 1 ] << 8 ) | ( it[ 2 ] << 16 ) | ( it[ 3 ] << 24 );
     it += 4;
 
-    std::vector<uint8_t>::const_iterator body_end = it + data_size;
+    midi_byte_span::const_iterator body_end = it + data_size;
 
 	if ( body_end - it < 4 ) return false;
     uint32_t segment_count = it[ 0 ] | ( it[ 1 ] << 8 ) | ( it[ 2 ] << 16 ) | ( it[ 3 ] << 24 );
@@ -73,7 +73,7 @@ bool midi_processor::process_mids( std::vector<uint8_t> const& p_file, midi_cont
 
 	bool is_eight_byte = !!(flags & 1);
 
-	midi_track track;
+	midi_track_builder track( p_out.get_memory_resource() );
 
 	unsigned current_timestamp = 0;
 
@@ -83,7 +83,7 @@ bool midi_processor::process_mids( std::vector<uint8_t> const& p_file, midi_cont
         it += 4;
         uint32_t segment_size = it[ 0 ] | ( it[ 1 ] << 8 ) | ( it[ 2 ] << 16 ) | ( it[ 3 ] << 24 );
         it += 4;
-        std::vector<uint8_t>::const_iterator segment_end = it + segment_size;
+        midi_byte_span::const_iterator segment_end = it + segment_size;
         while ( it != segment_end && it != body_end )
 		{
 			if ( segment_end - it < 4 ) return false;
@@ -128,7 +128,7 @@ bool midi_processor::process_mids( std::vector<uint8_t> const& p_file, midi_cont
 
 	track.add_event( midi_event( current_timestamp, midi_event::extended, 0, end_of_track, _countof( end_of_track ) ) );
 
-	p_out.add_track( track );
+	p_out.add_track( std::move( track.finalize() ) );
 
     return true;
 }
@@ -4,7 +4,7 @@ const uint8_t midi_processor::mus_default_tempo[5] = {0xFF, 0x51, 0x09, 0xA3, 0x
 
 const uint8_t midi_processor::mus_controllers[15] = {0,0,1,7,10,11,91,93,64,67,120,123,126,127,121};
 
-bool midi_processor::is_mus( std::vector<uint8_t> const& p_file )
+bool midi_processor::is_mus( midi_byte_span const& p_file )
 {
     if ( p_file.size() < 0x20 ) return false;
     if ( p_file[ 0 ] != 'M' || p_file[ 1 ] != 'U' || p_file[ 2 ] != 'S' || p_file[ 3 ] != 0x1A ) return false;
@@ -15,7 +15,7 @@ bool midi_processor::is_mus( std::vector<uint8_t> const& p_file )
     return false;
 }
 
-bool midi_processor::process_mus( std::vector<uint8_t> const& p_file, midi_container & p_out )
+bool midi_processor::process_mus( midi_byte_span const& p_file, midi_container & p_out )
 {
     uint16_t length = p_file[ 4 ] | ( p_file[ 5 ] << 8 );
     uint16_t offset = p_file[ 6 ] | ( p_file[ 7 ] << 8 );
@@ -23,13 +23,13 @@ bool midi_processor::process_mus( std::vector<uint8_t> const& p_file, midi_conta
 	p_out.initialize( 0, 0x59 );
 
 	{
-		midi_track track;
+		midi_track_builder track( p_out.get_memory_resource() );
 		track.add_event( midi_event( 0, midi_event::extended, 0, mus_default_tempo, _countof( mus_default_tempo ) ) );
 		track.add_event( midi_event( 0, midi_event::extended, 0, end_of_track, _countof( end_of_track ) ) );
-		p_out.add_track( track );
+		p_out.add_track( std::move( track.finalize() ) );
 	}
 
-	midi_track track;
+	midi_track_builder track( p_out.get_memory_resource() );
 
 	unsigned current_timestamp = 0;
 
@@ -38,7 +38,7 @@ bool midi_processor::process_mus( std::vector<uint8_t> const& p_file, midi_conta
 	if ( (size_t)offset >= p_file.size() || (size_t)(offset + length) > p_file.size() )
 		return false;
 
-    std::vector<uint8_t>::const_iterator it = p_file.begin() + offset, end = p_file.begin() + offset + length;
+    midi_byte_span::const_iterator it = p_file.begin() + offset, end = p_file.begin() + offset + length;
 
     uint8_t buffer[ 4 ];
 
@@ -145,7 +145,7 @@ bool midi_processor::process_mus( std::vector<uint8_t> const& p_file, midi_conta
 
 	track.add_event( midi_event( current_timestamp, midi_event::extended, 0, end_of_track, _countof( end_of_track ) ) );
 
-	p_out.add_track( track );
+	p_out.add_track( std::move( track.finalize() ) );
 
     return true;
 }
@@ -2,7 +2,7 @@
 
 #include <string.h>
 
-bool midi_processor::is_riff_midi( std::vector<uint8_t> const& p_file )
+bool midi_processor::is_riff_midi( midi_byte_span const& p_file )
 {
     if ( p_file.size() < 20 ) return false;
     if ( p_file[ 0 ] != 'R' || p_file[ 1 ] != 'I' || p_file[ 2 ] != 'F' || p_file[ 3 ] != 'F' ) return false;
@@ -12,9 +12,7 @@ bool midi_processor::is_riff_midi( std::vector<uint8_t> const& p_file )
          p_file[ 12 ] != 'd' || p_file[ 13 ] != 'a' || p_file[ 14 ] != 't' || p_file[ 15 ] != 'a' ) return false;
     uint32_t data_size = p_file[ 16 ] | ( p_file[ 17 ] << 8 ) | ( p_file[ 18 ] << 16 ) | ( p_file[ 19 ] << 24 );
     if ( data_size < 18 || p_file.size() < data_size + 20 || riff_size < data_size + 12 ) return false;
-    std::vector<uint8_t> test;
-    test.assign( p_file.begin() + 20, p_file.begin() + 20 + 18 );
-    return is_standard_midi( test );
+    return is_standard_midi( midi_byte_span( p_file.data() + 20, 18 ) );
 }
 
 static const char * riff_tag_mappings[][2] = 
@@ -41,21 +39,19 @@ static const char * riff_tag_mappings[][2] =
 	{ "ITCH", "technician" }
 };
 
-bool midi_processor::process_riff_midi( std::vector<uint8_t> const& p_file, midi_container & p_out )
+bool midi_processor::process_riff_midi( midi_byte_span const& p_file, midi_container & p_out, midi_processor_options const& p_options )
 {
     uint32_t file_size = p_file[ 4 ] | ( p_file[ 5 ] << 8 ) | ( p_file[ 6 ] << 16 ) | ( p_file[ 7 ] << 24 );
 
-    std::vector<uint8_t>::const_iterator it = p_file.begin() + 12;
+    midi_byte_span::const_iterator it = p_file.begin() + 12;
 
-    std::vector<uint8_t>::const_iterator body_end = p_file.begin() + 8 + file_size;
+    midi_byte_span::const_iterator body_end = p_file.begin() + 8 + file_size;
 
 	bool found_data = false;
 	bool found_info = false;
 
 	midi_meta_data meta_data;
 
-    std::vector<uint8_t> extra_buffer;
-
     while ( it != body_end )
 	{
 		if ( body_end - it < 8 ) return false;
@@ -65,9 +61,7 @@ bool midi_processor::process_riff_midi( std::vector<uint8_t> const& p_file, midi
 		{
 			if ( !found_data )
 			{
-                std::vector<uint8_t> midi_file;
-                midi_file.assign( it + 8, it + 8 + chunk_size );
-                if ( !process_standard_midi( midi_file, p_out ) ) return false;
+                if ( !process_standard_midi( midi_byte_span( it + 8, chunk_size ), p_out, p_options ) ) return false;
 				found_data = true;
             }
             else return false; /*throw exception_io_data( "Multiple RIFF data chunks found" );*/
@@ -77,18 +71,16 @@ bool midi_processor::process_riff_midi( std::vector<uint8_t> const& p_file, midi
         else if ( it[ 0 ] == 'D' && it[ 1 ] == 'I' && it[ 2 ] == 'S' && it[ 3 ] == 'P' )
 		{
             uint32_t type = it[ 8 ] | ( it[ 9 ] << 8 ) | ( it[ 10 ] << 16 ) | ( it[ 11 ] << 24 );
-			if ( type == 1 )
+			if ( type == 1 && chunk_size >= 4 )
 			{
-                extra_buffer.resize( chunk_size - 4 );
-                std::copy( it + 12, it + 8 + chunk_size, extra_buffer.begin() );
-                meta_data.add_item( midi_meta_data_item( 0, "display_name", (const char *) &extra_buffer[0] ) );
+                meta_data.add_item( midi_meta_data_item( 0, "display_name", (const char *) &it[12], chunk_size - 4 ) );
 			}
             it += 8 + chunk_size;
             if ( chunk_size & 1 && it != body_end ) ++it;
 		}
         else if ( it[ 0 ] == 'L' && it[ 1 ] == 'I' && it[ 2 ] == 'S' && it[ 3 ] == 'T' )
 		{
-            std::vector<uint8_t>::const_iterator chunk_end = it + 8 + chunk_size;
+            midi_byte_span::const_iterator chunk_end = it + 8 + chunk_size;
             if ( it[ 8 ] == 'I' && it[ 9 ] == 'N' && it[ 10 ] == 'F' && it[ 11 ] == 'O' )
 			{
 				if ( !found_info )
@@ -110,10 +102,8 @@ bool midi_processor::process_riff_midi( std::vector<uint8_t> const& p_file, midi
 								break;
 							}
 						}
-                        extra_buffer.resize( field_size );
-                        std::copy( it + 8, it + 8 + field_size, extra_buffer.begin() );
+                        meta_data.add_item( midi_meta_data_item( 0, field.c_str(), ( const char * ) &it[8], field_size ) );
                         it += 8 + field_size;
-                        meta_data.add_item( midi_meta_data_item( 0, field.c_str(), ( const char * ) &extra_buffer[0] ) );
                         if ( field_size & 1 && it != chunk_end ) ++it;
 					}
 					found_info = true;
@@ -1,6 +1,6 @@
 #include "midi_processor.h"
 
-bool midi_processor::is_standard_midi( std::vector<uint8_t> const& p_file )
+bool midi_processor::is_standard_midi( midi_byte_span const& p_file )
 {
     if ( p_file.size() < 18 ) return false;
     if ( p_file[ 0 ] != 'M' || p_file[ 1 ] != 'T' || p_file[ 2 ] != 'h' || p_file[ 3 ] != 'd') return false;
@@ -9,9 +9,16 @@ bool midi_processor::is_standard_midi( std::vector<uint8_t> const& p_file )
     return true;
 }
 
-bool midi_processor::process_standard_midi_track( std::vector<uint8_t>::const_iterator & it, std::vector<uint8_t>::const_iterator end, midi_container & p_out, bool needs_end_marker )
+bool midi_processor::process_standard_midi_track( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator end, midi_container & p_out, bool needs_end_marker )
+{
+	midi_track_builder track( p_out.get_memory_resource() );
+    if ( !decode_standard_midi_track( it, end, track, needs_end_marker ) ) return false;
+	p_out.add_track( std::move( track.finalize() ) );
+    return true;
+}
+
+bool midi_processor::decode_standard_midi_track( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator end, midi_track_builder & track, bool needs_end_marker )
 {
-	midi_track track;
 	unsigned current_timestamp = 0;
 	unsigned char last_event_code = 0xFF;
 
@@ -109,18 +116,16 @@ bool midi_processor::process_standard_midi_track( std::vector<uint8_t>::const_it
         track.add_event( midi_event( current_timestamp, midi_event::extended, 0, &buffer[0], 2 ) );
 	}
 
-	p_out.add_track( track );
-
     return true;
 }
 
-bool midi_processor::process_standard_midi( std::vector<uint8_t> const& p_file, midi_container & p_out )
+bool midi_processor::process_standard_midi( midi_byte_span const& p_file, midi_container & p_out, midi_processor_options const& p_options )
 {
     if ( p_file[ 0 ] != 'M' || p_file[ 1 ] != 'T' || p_file[ 2 ] != 'h' || p_file[ 3 ] != 'd' ) return false;
     if ( p_file[ 4 ] != 0 || p_file[ 5 ] != 0 || p_file[ 6 ] != 0 || p_file[ 7 ] != 6 ) return false; /*throw exception_io_data("Bad MIDI header size");*/
 
-    std::vector<uint8_t>::const_iterator it = p_file.begin() + 8;
-	std::vector<uint8_t>::const_iterator end = p_file.end();
+    midi_byte_span::const_iterator it = p_file.begin() + 8;
+	midi_byte_span::const_iterator end = p_file.end();
 
     uint16_t form = ( it[0] << 8 ) | it[1];
     if ( form > 2 ) return false;
@@ -134,26 +139,350 @@ bool midi_processor::process_standard_midi( std::vector<uint8_t> const& p_file,
 
 	p_out.initialize( form, dtx );
 
+    /*
+     * Locate every track first. A bad chunk header ends the list there;
+     * the tracks before it are still decoded and added, as a serial parse
+     * would have done before failing.
+     */
+    std::vector<midi_byte_span> track_bodies;
+    track_bodies.reserve( track_count );
+
+    bool headers_valid = true;
+
     for ( std::size_t i = 0; i < track_count; ++i )
 	{
-		if ( end - it < 8 ) return false;
-        if ( it[0] != 'M' || it[1] != 'T' || it[2] != 'r' || it[3] != 'k' ) return false;
+		if ( end - it < 8 || it[0] != 'M' || it[1] != 'T' || it[2] != 'r' || it[3] != 'k' )
+		{
+            headers_valid = false;
+            break;
+		}
 
         uint32_t track_size = ( it[4] << 24 ) | ( it[5] << 16 ) | ( it[6] << 8 ) | it[7];
-		if ( (unsigned long)(end - it) < track_size ) return false;
 
         it += 8;
 
-        intptr_t track_data_offset = it - p_file.begin();
+		if ( (unsigned long)(end - it) < track_size )
+		{
+            headers_valid = false;
+            break;
+		}
+
+        track_bodies.push_back( midi_byte_span( it, track_size ) );
+
+        it += track_size;
+	}
+
+    std::size_t decoded_count = track_bodies.size();
 
-        if ( !process_standard_midi_track( it, it + track_size, p_out, true ) ) return false;
+    if ( p_options.m_executor && decoded_count > 1 )
+	{
+        std::vector<midi_track_builder> tracks( decoded_count, midi_track_builder( p_out.get_memory_resource() ) );
+        std::vector<uint8_t> track_valid( decoded_count, 0 );
+
+        p_options.m_executor->run( decoded_count, [&]( std::size_t i )
+        {
+            midi_byte_span::const_iterator track_it = track_bodies[ i ].begin();
+            track_valid[ i ] = decode_standard_midi_track( track_it, track_bodies[ i ].end(), tracks[ i ], true );
+        } );
 
-		track_data_offset += track_size;
-        if ( it - p_file.begin() != track_data_offset )
+        for ( std::size_t i = 0; i < decoded_count; ++i )
+		{
+            if ( !track_valid[ i ] ) return false;
+            p_out.add_track( std::move( tracks[ i ].finalize() ) );
+		}
+	}
+    else
+	{
+        for ( std::size_t i = 0; i < decoded_count; ++i )
 		{
-            it = p_file.begin() + track_data_offset;
+            midi_byte_span::const_iterator track_it = track_bodies[ i ].begin();
+            if ( !process_standard_midi_track( track_it, track_bodies[ i ].end(), p_out, true ) ) return false;
 		}
 	}
 
+    return headers_valid;
+}
+
+bool midi_container_parser_sink::begin_file( unsigned p_form, unsigned, unsigned p_dtx )
+{
+    m_out.initialize( p_form, p_dtx );
+    return true;
+}
+
+bool midi_container_parser_sink::begin_track( std::size_t )
+{
+    m_track = midi_track_builder( m_out.get_memory_resource() );
+    return true;
+}
+
+bool midi_container_parser_sink::add_event( const midi_event & p_event )
+{
+    m_track.add_event( p_event );
+    return true;
+}
+
+bool midi_container_parser_sink::end_track()
+{
+    m_out.add_track( std::move( m_track.finalize() ) );
+    return true;
+}
+
+standard_midi_stream_parser::standard_midi_stream_parser( midi_parser_sink & p_sink )
+    : m_sink( p_sink )
+{
+    m_state = state_file_header;
+    m_needed = 14;
+    m_track_count = 0;
+    m_track_index = 0;
+    m_track_remaining = 0;
+    m_number = 0;
+    m_timestamp = 0;
+    m_last_event_code = 0xFF;
+    m_event_code = 0;
+    m_data_count = 0;
+    m_data_needed = 0;
+}
+
+bool standard_midi_stream_parser::fail()
+{
+    m_state = state_failed;
+    return false;
+}
+
+bool standard_midi_stream_parser::next_track()
+{
+    if ( ++m_track_index >= m_track_count )
+    {
+        m_state = state_done;
+        return true;
+    }
+    m_buffer.resize( 0 );
+    m_needed = 8;
+    m_state = state_track_header;
+    return true;
+}
+
+bool standard_midi_stream_parser::end_delta()
+{
+    /* Same wrap and sign flip as decode_delta feeding process_standard_midi_track */
+    if ( m_number & 0x80000000 ) m_number = 0 - m_number;
+    m_timestamp += m_number;
+    m_state = state_status;
+    return true;
+}
+
+bool standard_midi_stream_parser::end_length()
+{
+    if ( m_number & 0x80000000 ) return fail(); /*throw exception_io_data( "Invalid System Exclusive message" );*/
+    if ( m_number > m_track_remaining ) return fail();
+    m_needed = m_number;
+    if ( !m_needed ) return end_message();
+    m_state = state_payload;
+    return true;
+}
+
+bool standard_midi_stream_parser::end_channel_message()
+{
+    if ( !m_sink.add_event( midi_event( m_timestamp, (midi_event::event_type)(( m_event_code >> 4 ) - 8), m_event_code & 0x0F, m_data, m_data_count ) ) ) return fail();
+    m_number = 0;
+    m_state = state_delta;
     return true;
 }
+
+bool standard_midi_stream_parser::end_message()
+{
+    if ( !m_sink.add_event( midi_event( m_timestamp, midi_event::extended, 0, &m_buffer[0], m_buffer.size() ) ) ) return fail();
+
+    if ( m_buffer[ 0 ] == 0xFF && m_buffer[ 1 ] == 0x2F )
+    {
+        if ( !m_sink.end_track() ) return fail();
+        m_state = state_skip_track;
+        return true;
+    }
+
+    m_number = 0;
+    m_state = state_delta;
+    return true;
+}
+
+bool standard_midi_stream_parser::end_track_data()
+{
+    /* A number cut off by the end of the track reads as zero, as decode_delta does */
+    if ( m_state == state_length )
+    {
+        m_number = 0;
+        return end_length();
+    }
+    return fail(); /* Track ended without an end of track marker, or mid-message */
+}
+
+bool standard_midi_stream_parser::process_status( uint8_t p_byte )
+{
+    uint8_t event_code = p_byte;
+    m_data_count = 0;
+    if ( event_code < 0x80 )
+    {
+        if ( m_last_event_code == 0xFF ) return fail(); /*throw exception_io_data("First MIDI track event short encoded");*/
+        m_data[ m_data_count++ ] = event_code;
+        event_code = m_last_event_code;
+    }
+    if ( event_code < 0xF0 )
+    {
+        m_last_event_code = event_code;
+        m_event_code = event_code;
+        m_data_needed = ( ( event_code & 0xF0 ) == 0xC0 || ( event_code & 0xF0 ) == 0xD0 ) ? 1 : 2;
+        if ( m_data_count >= m_data_needed ) return end_channel_message();
+        m_state = state_channel_data;
+        return true;
+    }
+    else if ( event_code == 0xF0 )
+    {
+        m_buffer.assign( 1, 0xF0 );
+        m_number = 0;
+        m_state = state_length;
+        return true;
+    }
+    else if ( event_code == 0xFF )
+    {
+        m_buffer.assign( 1, 0xFF );
+        m_state = state_meta_type;
+        return true;
+    }
+    else if ( event_code >= 0xF8 && event_code <= 0xFE )
+    {
+        /* Sequencer specific events, single byte */
+        if ( !m_sink.add_event( midi_event( m_timestamp, midi_event::extended, 0, &event_code, 1 ) ) ) return fail();
+        m_number = 0;
+        m_state = state_delta;
+        return true;
+    }
+    else return fail(); /*throw exception_io_data("Unhandled MIDI status code");*/
+}
+
+bool standard_midi_stream_parser::feed( const uint8_t * p_data, std::size_t p_size )
+{
+    const uint8_t * it = p_data, * end = p_data + p_size;
+
+    for (;;)
+    {
+        switch ( m_state )
+        {
+        case state_done:
+            return true;
+
+        case state_failed:
+            return false;
+
+        case state_file_header:
+        case state_track_header:
+            {
+                if ( it == end ) return true;
+                std::size_t count = std::min<std::size_t>( m_needed, end - it );
+                m_buffer.insert( m_buffer.end(), it, it + count );
+                it += count;
+                m_needed -= count;
+                if ( m_needed ) return true;
+
+                const uint8_t * header = &m_buffer[0];
+                if ( m_state == state_file_header )
+                {
+                    if ( header[ 0 ] != 'M' || header[ 1 ] != 'T' || header[ 2 ] != 'h' || header[ 3 ] != 'd' ) return fail();
+                    if ( header[ 4 ] != 0 || header[ 5 ] != 0 || header[ 6 ] != 0 || header[ 7 ] != 6 ) return fail(); /*throw exception_io_data("Bad MIDI header size");*/
+                    unsigned form = ( header[ 8 ] << 8 ) | header[ 9 ];
+                    if ( form > 2 ) return fail();
+                    m_track_count = ( header[ 10 ] << 8 ) | header[ 11 ];
+                    unsigned dtx = ( header[ 12 ] << 8 ) | header[ 13 ];
+                    if ( !m_sink.begin_file( form, m_track_count, dtx ) ) return fail();
+                    m_track_index = 0;
+                    m_buffer.resize( 0 );
+                    m_needed = 8;
+                    m_state = m_track_count ? state_track_header : state_done;
+                }
+                else
+                {
+                    if ( header[ 0 ] != 'M' || header[ 1 ] != 'T' || header[ 2 ] != 'r' || header[ 3 ] != 'k' ) return fail();
+                    m_track_remaining = ( header[ 4 ] << 24 ) | ( header[ 5 ] << 16 ) | ( header[ 6 ] << 8 ) | header[ 7 ];
+                    m_timestamp = 0;
+                    m_last_event_code = 0xFF;
+                    m_number = 0;
+                    if ( !m_sink.begin_track( m_track_index ) ) return fail();
+                    m_state = state_delta;
+                }
+            }
+            break;
+
+        case state_skip_track:
+            if ( m_track_remaining )
+            {
+                if ( it == end ) return true;
+                std::size_t count = std::min<std::size_t>( m_track_remaining, end - it );
+                it += count;
+                m_track_remaining -= (uint32_t) count;
+            }
+            if ( !m_track_remaining ) next_track();
+            break;
+
+        case state_payload:
+            {
+                if ( it == end ) return true;
+                std::size_t count = std::min<std::size_t>( m_needed, end - it );
+                m_buffer.insert( m_buffer.end(), it, it + count );
+                it += count;
+                m_needed -= count;
+                m_track_remaining -= (uint32_t) count;
+                if ( !m_needed && !end_message() ) return false;
+            }
+            break;
+
+        default:
+            {
+                if ( !m_track_remaining )
+                {
+                    if ( !end_track_data() ) return false;
+                    break;
+                }
+
+                if ( it == end ) return true;
+                uint8_t byte = *it++;
+                --m_track_remaining;
+
+                switch ( m_state )
+                {
+                case state_delta:
+                    m_number = ( m_number << 7 ) + ( byte & 0x7F );
+                    if ( !( byte & 0x80 ) ) end_delta();
+                    break;
+
+                case state_length:
+                    m_number = ( m_number << 7 ) + ( byte & 0x7F );
+                    if ( !( byte & 0x80 ) && !end_length() ) return false;
+                    break;
+
+                case state_status:
+                    if ( !process_status( byte ) ) return false;
+                    break;
+
+                case state_channel_data:
+                    m_data[ m_data_count++ ] = byte;
+                    if ( m_data_count >= m_data_needed && !end_channel_message() ) return false;
+                    break;
+
+                case state_meta_type:
+                    m_buffer.push_back( byte );
+                    m_number = 0;
+                    m_state = state_length;
+                    break;
+
+                default:
+                    break;
+                }
+            }
+            break;
+        }
+    }
+}
+
+bool standard_midi_stream_parser::finish()
+{
+    return m_state == state_done;
+}
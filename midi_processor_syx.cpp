@@ -1,20 +1,20 @@
 #include "midi_processor.h"
 
-bool midi_processor::is_syx( std::vector<uint8_t> const& p_file )
+bool midi_processor::is_syx( midi_byte_span const& p_file )
 {
     if ( p_file.size() < 2 ) return false;
     if ( p_file[ 0 ] != 0xF0 || p_file[ p_file.size() - 1 ] != 0xF7 ) return false;
     return true;
 }
 
-bool midi_processor::process_syx( std::vector<uint8_t> const& p_file, midi_container & p_out )
+bool midi_processor::process_syx( midi_byte_span const& p_file, midi_container & p_out )
 {
     const size_t size = p_file.size();
     size_t ptr = 0;
 
     p_out.initialize( 0, 1 );
 
-    midi_track track;
+    midi_track_builder track( p_out.get_memory_resource() );
 
     while ( ptr < size )
     {
@@ -29,7 +29,7 @@ bool midi_processor::process_syx( std::vector<uint8_t> const& p_file, midi_conta
         ptr += msg_length;
     }
 
-    p_out.add_track( track );
+    p_out.add_track( std::move( track.finalize() ) );
 
     return true;
 }
@@ -2,7 +2,10 @@
 
 #include <string.h>
 
-bool midi_processor::is_xmi( std::vector<uint8_t> const& p_file )
+#include <functional>
+#include <queue>
+
+bool midi_processor::is_xmi( midi_byte_span const& p_file )
 {
     if ( p_file.size() < 0x22 ) return false;
     if ( p_file[ 0 ] != 'F' || p_file[ 1 ] != 'O' || p_file[ 2 ] != 'R' || p_file[ 3 ] != 'M' ||
@@ -13,30 +16,70 @@ bool midi_processor::is_xmi( std::vector<uint8_t> const& p_file )
 
 const uint8_t midi_processor::xmi_default_tempo[5] = {0xFF, 0x51, 0x07, 0xA1, 0x20};
 
-unsigned midi_processor::decode_xmi_delta( std::vector<uint8_t>::const_iterator & it, std::vector<uint8_t>::const_iterator end )
+unsigned midi_processor::decode_xmi_delta( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator end )
 {
 	unsigned delta = 0;
 	if ( it == end ) return 0;
-    uint8_t byte = *it++;
-	if ( !( byte & 0x80 ) )
-	{
-		do
-		{
-			delta += byte;
-			if ( it == end ) break;
-            byte = *it++;
-		}
-        while ( !( byte & 0x80 ) && it != end );
-	}
-    --it;
+
+    /*
+     * Sums the bytes before the next status byte and leaves it there. Without
+     * one, the last byte of the input is left unread; a lone byte is counted.
+     */
+    midi_byte_span::const_iterator stop = find_delta_stop( it, end, true );
+    if ( stop == end )
+    {
+        stop = end - 1;
+        if ( stop == it ) return *it;
+    }
+
+    while ( it != stop ) delta += *it++;
 	return delta;
 }
 
+/*
+ * Note-off synthesized from an XMI note duration, waiting for the delta
+ * clock to reach it. Ordered by time, then by the order the notes were read.
+ */
+struct xmi_pending_note_off
+{
+    unsigned m_timestamp;
+    unsigned m_sequence;
+    uint8_t m_channel;
+    uint8_t m_note;
+
+    xmi_pending_note_off( unsigned p_timestamp, unsigned p_sequence, uint8_t p_channel, uint8_t p_note )
+        : m_timestamp( p_timestamp ), m_sequence( p_sequence ), m_channel( p_channel ), m_note( p_note ) { }
+
+    bool operator > ( const xmi_pending_note_off & p_other ) const
+    {
+        if ( m_timestamp != p_other.m_timestamp ) return m_timestamp > p_other.m_timestamp;
+        return m_sequence > p_other.m_sequence;
+    }
+};
+
+typedef std::priority_queue<xmi_pending_note_off, std::vector<xmi_pending_note_off>, std::greater<xmi_pending_note_off> > xmi_note_off_queue;
+
+/*
+ * Appends every pending note-off due at or before p_timestamp. Events at
+ * equal times keep the order they were read in, so the track stays in the
+ * order a stable sort of the raw event list would give.
+ */
+static void flush_note_offs( xmi_note_off_queue & p_queue, unsigned long p_timestamp, midi_track_builder & p_track )
+{
+    while ( !p_queue.empty() && p_queue.top().m_timestamp <= p_timestamp )
+    {
+        const xmi_pending_note_off & note_off = p_queue.top();
+        uint8_t data[2] = { note_off.m_note, 0 };
+        p_track.add_event( midi_event( note_off.m_timestamp, midi_event::note_on, note_off.m_channel, data, 2 ) );
+        p_queue.pop();
+    }
+}
+
 struct iff_chunk
 {
     uint8_t m_id[4];
     uint8_t m_type[4];
-    std::vector<uint8_t> m_data;
+    midi_byte_span m_data;
     std::vector<iff_chunk> m_sub_chunks;
 
 	iff_chunk()
@@ -45,40 +88,33 @@ struct iff_chunk
 		memset( m_type, 0, sizeof( m_type ) );
 	}
 
-	iff_chunk( const iff_chunk & p_in )
-	{
-		memcpy( m_id, p_in.m_id, sizeof( m_id ) );
-		memcpy( m_type, p_in.m_type, sizeof( m_type ) );
-		m_data = p_in.m_data;
-		m_sub_chunks = p_in.m_sub_chunks;
-	}
-
 	const iff_chunk & find_sub_chunk( const char * p_id, unsigned index = 0 ) const
 	{
         for ( std::size_t i = 0; i < m_sub_chunks.size(); ++i )
 		{
 			if ( !memcmp( p_id, m_sub_chunks[ i ].m_id, 4 ) )
 			{
-				if ( index ) --index;
 				if ( !index ) return m_sub_chunks[ i ];
+				--index;
 			}
 		}
         /*throw exception_io_data( pfc::string_formatter() << "Missing IFF chunk: " << p_id );*/
         return *this;
 	}
 
-	unsigned get_chunk_count( const char * p_id ) const
-	{
-		unsigned chunk_count = 0;
+    /*
+     * Collects every sub-chunk with the given id in one pass, for callers
+     * that would otherwise look each one up by index.
+     */
+    void find_sub_chunks( const char * p_id, std::vector<const iff_chunk *> & p_out ) const
+    {
+        p_out.resize( 0 );
         for ( std::size_t i = 0; i < m_sub_chunks.size(); ++i )
         {
 			if ( !memcmp( p_id, m_sub_chunks[ i ].m_id, 4 ) )
-			{
-				++chunk_count;
-			}
-		}
-		return chunk_count;
-	}
+				p_out.push_back( &m_sub_chunks[ i ] );
+        }
+    }
 };
 
 struct iff_stream
@@ -101,7 +137,11 @@ struct iff_stream
 	}
 };
 
-static bool read_iff_chunk( std::vector<uint8_t>::const_iterator & it, std::vector<uint8_t>::const_iterator end, iff_chunk & p_out, bool first_chunk )
+/*
+ * Chunks are read straight into their final place in the parent's list,
+ * and leaf chunks keep a view of the input rather than a copy of it.
+ */
+static bool read_iff_chunk( midi_byte_span::const_iterator & it, midi_byte_span::const_iterator end, iff_chunk & p_out, bool first_chunk )
 {
 	if ( end - it < 8 ) return false;
     std::copy( it, it + 4, p_out.m_id );
@@ -116,21 +156,20 @@ static bool read_iff_chunk( std::vector<uint8_t>::const_iterator & it, std::vect
 	if ( ( first_chunk && is_form_chunk ) || ( !first_chunk && is_cat_chunk ) )
 	{
 		if ( end - it < 4 ) return false;
-        std::vector<uint8_t>::const_iterator chunk_end = it + chunk_size;
+        midi_byte_span::const_iterator chunk_end = it + chunk_size;
         std::copy( it, it + 4, p_out.m_type );
         it += 4;
         while ( it < chunk_end )
 		{
-			iff_chunk chunk;
-            if ( !read_iff_chunk( it, chunk_end, chunk, is_cat_chunk ) ) return false;
-            p_out.m_sub_chunks.push_back( chunk );
+            p_out.m_sub_chunks.push_back( iff_chunk() );
+            if ( !read_iff_chunk( it, chunk_end, p_out.m_sub_chunks.back(), is_cat_chunk ) ) return false;
 		}
         it = chunk_end;
         if ( chunk_size & 1 && it != end ) ++it;
 	}
 	else if ( !is_form_chunk && !is_cat_chunk )
 	{
-        p_out.m_data.assign( it, it + chunk_size );
+        p_out.m_data = midi_byte_span( it, chunk_size );
         it += chunk_size;
         if ( chunk_size & 1 && it != end ) ++it;
 	}
@@ -143,27 +182,30 @@ static bool read_iff_chunk( std::vector<uint8_t>::const_iterator & it, std::vect
     return true;
 }
 
-static bool read_iff_stream( std::vector<uint8_t> const& p_file, iff_stream & p_out )
+static bool read_iff_stream( midi_byte_span const& p_file, iff_stream & p_out )
 {
-    std::vector<uint8_t>::const_iterator it = p_file.begin(), end = p_file.end();
+    midi_byte_span::const_iterator it = p_file.begin(), end = p_file.end();
 	bool first_chunk = true;
     while ( it != end )
 	{
-		iff_chunk chunk;
-        if ( read_iff_chunk( it, end, chunk, first_chunk ) )
+        p_out.m_chunks.push_back( iff_chunk() );
+        if ( read_iff_chunk( it, end, p_out.m_chunks.back(), first_chunk ) )
         {
-            p_out.m_chunks.push_back( chunk );
             first_chunk = false;
         }
-        else if ( first_chunk )
-            return false;
         else
-            break;
+        {
+            p_out.m_chunks.pop_back();
+            if ( first_chunk )
+                return false;
+            else
+                break;
+        }
 	}
     return true;
 }
 
-bool midi_processor::process_xmi( std::vector<uint8_t> const& p_file, midi_container & p_out )
+bool midi_processor::process_xmi( midi_byte_span const& p_file, midi_container & p_out )
 {
 	iff_stream xmi_file;
     if ( !read_iff_stream( p_file, xmi_file ) ) return false;
@@ -174,20 +216,23 @@ bool midi_processor::process_xmi( std::vector<uint8_t> const& p_file, midi_conta
 	const iff_chunk & cat_chunk = xmi_file.find_chunk( "CAT " );
     if ( memcmp( cat_chunk.m_type, "XMID", 4 ) ) return false; /*throw exception_io_data( "XMI CAT chunk not XMID type" );*/
 
-	unsigned track_count = cat_chunk.get_chunk_count( "FORM" );
+    std::vector<const iff_chunk *> form_chunks;
+    cat_chunk.find_sub_chunks( "FORM", form_chunks );
+
+	unsigned track_count = (unsigned) form_chunks.size();
 
 	p_out.initialize( track_count > 1 ? 2 : 0, 60 );
 
 	for ( unsigned i = 0; i < track_count; ++i )
 	{
-		const iff_chunk & xmid_form_chunk = cat_chunk.find_sub_chunk( "FORM", i );
+		const iff_chunk & xmid_form_chunk = *form_chunks[ i ];
         if ( memcmp( xmid_form_chunk.m_type, "XMID", 4 ) ) return false; /*throw exception_io_data( "XMI nested FORM chunk not XMID type" );*/
 
 		const iff_chunk & event_chunk = xmid_form_chunk.find_sub_chunk( "EVNT" );
         if ( memcmp( event_chunk.m_id, "EVNT", 4 ) ) return false; /* EVNT chunk not found */
-        std::vector<uint8_t> const& event_body = event_chunk.m_data;
+        midi_byte_span const& event_body = event_chunk.m_data;
 
-		midi_track track;
+		midi_track_builder track( p_out.get_memory_resource() );
 
 		bool initial_tempo = false;
 
@@ -195,10 +240,13 @@ bool midi_processor::process_xmi( std::vector<uint8_t> const& p_file, midi_conta
 
 		unsigned last_event_timestamp = 0;
 
+        xmi_note_off_queue note_offs;
+        unsigned note_off_sequence = 0;
+
         std::vector<uint8_t> buffer;
         buffer.resize( 3 );
 
-        std::vector<uint8_t>::const_iterator it = event_body.begin(), end = event_body.end();
+        midi_byte_span::const_iterator it = event_body.begin(), end = event_body.end();
 
         while ( it != end )
 		{
@@ -244,6 +292,7 @@ bool midi_processor::process_xmi( std::vector<uint8_t> const& p_file, midi_conta
 					buffer[ 4 ] = tempo;
 					if ( current_timestamp == 0 ) initial_tempo = true;
 				}
+                flush_note_offs( note_offs, current_timestamp, track );
                 track.add_event( midi_event( current_timestamp, midi_event::extended, 0, &buffer[0], meta_count + 2 ) );
 				if ( buffer[ 1 ] == 0x2F ) break;
 			}
@@ -255,6 +304,7 @@ bool midi_processor::process_xmi( std::vector<uint8_t> const& p_file, midi_conta
                 buffer.resize( system_exclusive_count + 1 );
                 std::copy( it, it + system_exclusive_count, buffer.begin() + 1 );
                 it += system_exclusive_count;
+                flush_note_offs( note_offs, current_timestamp, track );
                 track.add_event( midi_event( current_timestamp, midi_event::extended, 0, &buffer[0], system_exclusive_count + 1 ) );
 			}
 			else if ( buffer[ 0 ] >= 0x80 && buffer[ 0 ] <= 0xEF )
@@ -270,6 +320,7 @@ bool midi_processor::process_xmi( std::vector<uint8_t> const& p_file, midi_conta
                     buffer[ 2 ] = *it++;
 					bytes_read = 2;
 				}
+                flush_note_offs( note_offs, current_timestamp, track );
                 track.add_event( midi_event( current_timestamp, type, channel, &buffer[1], bytes_read ) );
 				if ( type == midi_event::note_on )
 				{
@@ -278,16 +329,24 @@ bool midi_processor::process_xmi( std::vector<uint8_t> const& p_file, midi_conta
                     if ( note_length < 0 ) return false; /*throw exception_io_data( "Invalid XMI note message" );*/
 					unsigned note_end_timestamp = current_timestamp + note_length;
 					if ( note_end_timestamp > last_event_timestamp ) last_event_timestamp = note_end_timestamp;
-                    track.add_event( midi_event( note_end_timestamp, type, channel, &buffer[1], bytes_read ) );
+                    if ( note_end_timestamp >= current_timestamp )
+                        note_offs.push( xmi_pending_note_off( note_end_timestamp, note_off_sequence++, (uint8_t) channel, buffer[ 1 ] ) );
+                    else
+                        track.add_event( midi_event( note_end_timestamp, type, channel, &buffer[1], bytes_read ) ); /* wrapped; left for the final sort */
 				}
 			}
             else return false; /*throw exception_io_data( "Unexpected XMI status code" );*/
 		}
 
+        flush_note_offs( note_offs, ~0UL, track );
+
+        midi_track & finished_track = track.finalize();
+
+        /* Inserting into the finished track places it exactly where sorting it in would */
 		if ( !initial_tempo )
-			track.add_event( midi_event( 0, midi_event::extended, 0, xmi_default_tempo, _countof( xmi_default_tempo ) ) );
+			finished_track.add_event( midi_event( 0, midi_event::extended, 0, xmi_default_tempo, _countof( xmi_default_tempo ) ) );
 
-		p_out.add_track( track );
+		p_out.add_track( std::move( finished_track ) );
 	}
 
     return true;